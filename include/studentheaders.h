@@ -1,8 +1,92 @@
 #ifndef STUDENTHEADERS_H
 #define STUDENTHEADERS_H
 
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bdd.h"
+
+// Set in global_options by -c, which crops birp decoded to pgm or ascii (bits 12-15 are otherwise unused).
+#define CROP_OPTION (0x1000)
+
+// Set in global_options by -e, which encodes pgm to birp lossily, with the error bound in bits 16-23.
+#define LOSSY_OPTION (0x2000)
+
+// Set in global_options by -p, which quantizes pgm encoded to birp to posterize_levels gray levels.
+#define POSTERIZE_OPTION (0x4000)
+
+extern int crop_x;
+extern int crop_y;
+extern int crop_width;
+extern int crop_height;
+
+extern int posterize_levels;
+
 int power(int base, int raise);
 
-int freeSpot();
+BDD_NODE *bdd_node_at(int index);
+
+int bdd_node_index(BDD_NODE *node);
+
+int bdd_node_alloc();
+
+void bdd_node_free(int index);
+
+int bdd_node_high_water();
+
+int bdd_hash_reset();
+
+int bdd_gc_register_root(BDD_NODE **root);
+
+void bdd_gc_unregister_root(BDD_NODE **root);
+
+int bdd_gc(int compact);
+
+int bdd_concurrent_begin(int nodes);
+
+int bdd_lookup_concurrent(int level, int left, int right);
+
+void bdd_concurrent_end();
+
+void bdd_set_threads(int threads);
+
+void bdd_set_tile_cache(int entries);
+
+int bdd_apply_batch(BDD_NODE *node, const int *coords, int n, unsigned char *out);
+
+int bdd_serialize_records(BDD_NODE *node, FILE *out, int delta);
+
+BDD_NODE *bdd_deserialize_records(FILE *in, int delta);
+
+BDD_NODE *bdd_deserialize_buffer(const uint8_t *data, size_t size, int delta);
+
+int bdd_serialize_indexed(BDD_NODE *node, int w, int h, FILE *out, int delta);
+
+BDD_NODE *bdd_deserialize_window(const uint8_t *data, size_t size, int delta, int w, int h,
+                                 int x, int y, int ww, int wh);
+
+BDD_NODE *bdd_approximate(BDD_NODE *node, int tolerance);
+
+int bdd_node_count(BDD_NODE *node);
+
+int bdd_set_posterize(int levels);
+
+int bdd_to_raster_region(BDD_NODE *node, int x, int y, int w, int h, unsigned char *out);
+
+int img_map_pgm(FILE *in, int *wp, int *hp, unsigned char **pixels);
+
+void img_unmap(void);
+
+int img_write_pgm_header(int w, int h, FILE *out);
+
+void img_set_birp_version(int version);
+
+void img_set_birp_index(int index);
+
+BDD_NODE *img_read_birp_window(FILE *file, int *wp, int *hp, int x, int y, int w, int h);
+
+FILE *entropy_open_writer(FILE *out);
+
+FILE *entropy_open_reader(FILE *in);
 
 #endif
\ No newline at end of file
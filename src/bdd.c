@@ -1,5 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "bdd.h"
 #include "debug.h"
@@ -7,30 +12,312 @@
 #include "studentheaders.h"
 
 
+/*
+ * Node storage.
+ * Indices below BDD_NODES_MAX live in the bdd_nodes array from bdd.h, and their serial
+ * numbers in bdd_index_map. Larger indices live in an extension segment: address space for
+ * BDD_NODES_LIMIT nodes is reserved on first use and committed a chunk at a time as the
+ * allocator reaches it, so the table grows on demand without ever moving a node.
+ */
+#define BDD_NODES_LIMIT (1 << 28)
+#define BDD_EXT_NODES (BDD_NODES_LIMIT - BDD_NODES_MAX)
+#define BDD_EXT_CHUNK (1 << 16)
+
+static BDD_NODE *bdd_nodes_ext = NULL;
+static int *bdd_index_map_ext = NULL;
+static int bdd_ext_committed = 0; // Extension slots backed by memory so far.
+
+// Convert between node indices and node pointers, and find the index-map entry of an index.
+#define NODE(i) ((i) < BDD_NODES_MAX ? bdd_nodes + (i) : bdd_nodes_ext + ((i) - BDD_NODES_MAX))
+#define INDEX(np) ((np) >= bdd_nodes && (np) < bdd_nodes + BDD_NODES_MAX ? (int)((np) - bdd_nodes) \
+                   : BDD_NODES_MAX + (int)((np) - bdd_nodes_ext))
+#define INDEX_MAP(i) ((i) < BDD_NODES_MAX ? bdd_index_map + (i) : bdd_index_map_ext + ((i) - BDD_NODES_MAX))
+
 /*
  * Macros that take a pointer to a BDD node and obtain pointers to its left
  * and right child nodes, taking into account the fact that a node N at level l
  * also implicitly represents nodes at levels l' > l whose left and right children
  * are equal (to N).
- *
- * You might find it useful to define macros to do other commonly occurring things;
- * such as converting between BDD node pointers and indices in the BDD node table.
  */
-#define LEFT(np, l) ((l) > (np)->level ? (np) : bdd_nodes + (np)->left)
-#define RIGHT(np, l) ((l) > (np)->level ? (np) : bdd_nodes + (np)->right)
+#define LEFT(np, l) ((l) > (np)->level ? (np) : NODE((np)->left))
+#define RIGHT(np, l) ((l) > (np)->level ? (np) : NODE((np)->right))
+
+// Make sure every extension slot below the given index is backed by memory. Returns -1 on failure.
+static int bdd_ext_commit(int index) {
+    int needed = index - BDD_NODES_MAX;
+    if (needed <= bdd_ext_committed) { return 0; }
+    if (needed > BDD_EXT_NODES) { return -1; }
+
+    if (bdd_nodes_ext == NULL) {
+        void *nodes = mmap(NULL, (size_t)BDD_EXT_NODES * sizeof(BDD_NODE), PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (nodes == MAP_FAILED) { return -1; }
+        void *serials = mmap(NULL, (size_t)BDD_EXT_NODES * sizeof(int), PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (serials == MAP_FAILED) {
+            munmap(nodes, (size_t)BDD_EXT_NODES * sizeof(BDD_NODE));
+            return -1;
+        }
+        bdd_nodes_ext = nodes;
+        bdd_index_map_ext = serials;
+    }
+
+    // Chunks are a multiple of the page size for both segments, so offsets stay page-aligned.
+    int target = ((needed + BDD_EXT_CHUNK - 1) / BDD_EXT_CHUNK) * BDD_EXT_CHUNK;
+    if (target > BDD_EXT_NODES) { target = BDD_EXT_NODES; }
+    size_t count = (size_t)(target - bdd_ext_committed);
+    if (mprotect(bdd_nodes_ext + bdd_ext_committed, count * sizeof(BDD_NODE), PROT_READ | PROT_WRITE) == -1) { return -1; }
+    if (mprotect(bdd_index_map_ext + bdd_ext_committed, count * sizeof(int), PROT_READ | PROT_WRITE) == -1) { return -1; }
+    bdd_ext_committed = target;
+    return 0;
+}
+
+// One past the highest index with memory behind it: the static table and the committed extension.
+static int bdd_node_extent() {
+    return BDD_NODES_MAX + bdd_ext_committed;
+}
+
+// Resolve a node index to its slot, for code outside this file.
+BDD_NODE *bdd_node_at(int index) {
+    return NODE(index);
+}
 
-// Find the index of the next free spot in bdd_nodes.
-int freeSpot() {
-    for (int i = 256; i < BDD_NODES_MAX; i++) {
-        BDD_NODE *current = bdd_nodes + i;
-        //debug("%i level, %i left, %i right\n", current->level, current->left, current->right);
-        if (current->level == 0) {
-            return i;
+// Resolve a node pointer back to its index, for code outside this file.
+int bdd_node_index(BDD_NODE *node) {
+    return INDEX(node);
+}
+
+/*
+ * Node allocator.
+ * Internal nodes are handed out from a bump pointer that starts just past the leaves.
+ * Slots given back through bdd_node_free() are chained through their "left" field and
+ * are reused before the bump pointer advances, so neither path ever scans bdd_nodes.
+ * A freed slot is tagged with FREE_LEVEL so the garbage collector can tell it apart
+ * from a live node.
+ */
+#define FREE_LEVEL ((char)-1)
+
+static int bdd_bump_index = BDD_NUM_LEAVES; // Next never-used slot; also the high-water mark.
+static int bdd_free_list = -1;              // Most recently freed slot, or -1 if none.
+
+// Hand out the index of an unused node slot, or -1 if no more memory can be committed.
+int bdd_node_alloc() {
+    if (bdd_free_list != -1) {
+        int index = bdd_free_list;
+        bdd_free_list = NODE(index)->left;
+        return index;
+    }
+    if (bdd_bump_index >= BDD_NODES_LIMIT) { return -1; }
+    if (bdd_bump_index >= BDD_NODES_MAX && bdd_ext_commit(bdd_bump_index + 1) == -1) { return -1; }
+    return bdd_bump_index++;
+}
+
+// Return a slot to the allocator. The caller must already have removed it from the unique table.
+void bdd_node_free(int index) {
+    if (index < BDD_NUM_LEAVES || index >= bdd_bump_index) { return; }
+    BDD_NODE freed = {FREE_LEVEL, bdd_free_list, bdd_free_list};
+    *NODE(index) = freed;
+    bdd_free_list = index;
+}
+
+// One past the highest index ever handed out; every live node lies below this.
+int bdd_node_high_water() {
+    return bdd_bump_index;
+}
+
+/*
+ * Serial numbers.
+ * bdd_serialize() numbers nodes in bdd_index_map, with 0 meaning "not numbered yet". Rather
+ * than clearing the map before every pass, each pass stores its serials offset by
+ * bdd_serial_base and advances the base past them when it is done, so every entry left by an
+ * earlier pass reads as unnumbered. Only when the base would overflow is the map cleared for
+ * real. (bdd_deserialize() uses the map the other way round, from serials to indices, and
+ * zeroes the entries it used when done.)
+ */
+static int bdd_serial_base = 0;
+
+#define SERIAL_OF(i) (*INDEX_MAP(i) > bdd_serial_base ? *INDEX_MAP(i) - bdd_serial_base : 0)
+#define SET_SERIAL(i, s) (*INDEX_MAP(i) = bdd_serial_base + (s))
+
+// Start a numbering pass, making room for up to BDD_NODES_LIMIT serials above the base.
+static void bdd_serial_begin() {
+    if (bdd_serial_base <= INT32_MAX - BDD_NODES_LIMIT) { return; }
+    for (int i = 0; i < bdd_bump_index; i++) {
+        *INDEX_MAP(i) = 0;
+    }
+    bdd_serial_base = 0;
+}
+
+// End a numbering pass that handed out serials below next.
+static void bdd_serial_end(int next) {
+    bdd_serial_base += next - 1;
+}
+
+
+/*
+ * Unique table.
+ * An open-addressed table whose power-of-two capacity starts small and doubles whenever
+ * it would pass half full. (It supersedes the fixed-size bdd_hash_map of bdd.h, which
+ * cannot index more than BDD_NODES_MAX nodes.) Slots hold 32-bit node indices, with 0
+ * meaning empty since index 0 is a leaf and leaves are never stored. Growth is
+ * incremental: the previous table stays readable, and every insertion copies a few more
+ * of its slots across, so no single lookup pays for rehashing everything.
+ */
+#define BDD_TABLE_INITIAL (1 << 12)
+#define BDD_REHASH_STEP 8
+#define EMPTY_SLOT 0
+
+/*
+ * Pack a (level, left, right) triple into one 64-bit word: 6 bits of level above two
+ * 29-bit child indices, which is room enough for BDD_NODES_LIMIT. The unique table hashes
+ * and compares nodes in this form, so a probe costs one 64-bit compare per slot.
+ */
+#define PACK(level, left, right) (((uint64_t)(level) << 58) | ((uint64_t)(uint32_t)(left) << 29) | (uint64_t)(uint32_t)(right))
+#define NODE_KEY(np) PACK((np)->level, (np)->left, (np)->right)
+
+static void bdd_cache_flush();
+
+static uint32_t *bdd_table = NULL;     // Table receiving insertions.
+static int bdd_table_mask = 0;         // Its capacity - 1.
+static int bdd_table_count = 0;        // Entries in it, counting those copied from the old table.
+static uint32_t *bdd_old_table = NULL; // Table being drained into bdd_table, or NULL.
+static int bdd_old_mask = 0;
+static int bdd_old_cursor = 0;         // Next slot of the old table to copy.
+
+// Spread a packed key over the table with the splitmix64 finalizer.
+static uint64_t bdd_hash(uint64_t key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+/*
+ * Find the slot of a table holding the node with the given packed key, or else the empty
+ * slot where it belongs. Linear probing from the home slot: tables are kept at most half
+ * full, so an empty slot always ends the sequence, and the probe count is capped so a full
+ * table can't spin forever. Returns -1 only in that last case.
+ */
+static int bdd_probe(uint32_t *table, int mask, uint64_t key) {
+    int slot = (int)(bdd_hash(key) & mask);
+    for (int probes = 0; probes <= mask; probes++) {
+        uint32_t index = *(table + slot);
+        if (index == EMPTY_SLOT || NODE_KEY(NODE(index)) == key) { return slot; }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// Copy up to steps slots of the old table across, releasing it once it has been drained.
+static void bdd_rehash_step(int steps) {
+    while (bdd_old_table != NULL && steps-- > 0) {
+        uint32_t index = *(bdd_old_table + bdd_old_cursor);
+        if (index != EMPTY_SLOT) {
+            *(bdd_table + bdd_probe(bdd_table, bdd_table_mask, NODE_KEY(NODE(index)))) = index;
+            bdd_table_count++;
         }
+        bdd_old_cursor++;
+        if (bdd_old_cursor > bdd_old_mask) {
+            free(bdd_old_table);
+            bdd_old_table = NULL;
+        }
+    }
+}
+
+// Double the capacity. The current table becomes the old table and is drained incrementally.
+static int bdd_table_grow() {
+    bdd_rehash_step(bdd_old_mask + 1); // finish any drain still in progress.
+    uint32_t *grown = calloc((size_t)(bdd_table_mask + 1) * 2, sizeof(uint32_t));
+    if (grown == NULL) { return -1; }
+    bdd_old_table = bdd_table;
+    bdd_old_mask = bdd_table_mask;
+    bdd_old_cursor = 0;
+    bdd_table = grown;
+    bdd_table_mask = 2 * bdd_table_mask + 1;
+    bdd_table_count = 0;
+    return 0;
+}
+
+/*
+ * Empty the unique table. Nodes already in the node table are left alone, but are no
+ * longer found by bdd_lookup. A grown table is dropped rather than cleared, so the cost
+ * of a reset does not depend on how large earlier BDDs made the table.
+ */
+int bdd_hash_reset() {
+    if (bdd_table != NULL && bdd_table_mask + 1 > BDD_TABLE_INITIAL) {
+        free(bdd_table);
+        bdd_table = NULL;
+    }
+    if (bdd_table == NULL) {
+        bdd_table = calloc(BDD_TABLE_INITIAL, sizeof(uint32_t));
+        if (bdd_table == NULL) { return -1; }
+        bdd_table_mask = BDD_TABLE_INITIAL - 1;
+    }
+    else {
+        memset(bdd_table, 0, (size_t)(bdd_table_mask + 1) * sizeof(uint32_t));
     }
-    return -1; // Error has occurred, no free spaces.
+    free(bdd_old_table);
+    bdd_old_table = NULL;
+    bdd_table_count = 0;
+    bdd_cache_flush(); // cached results may not be canonical in the emptied table.
+    return 0;
 }
 
+// The index of the node with the given packed key, from either table, or -1 if there is none.
+static int bdd_hash_find(uint64_t key) {
+    int slot = bdd_probe(bdd_table, bdd_table_mask, key);
+    if (slot != -1 && *(bdd_table + slot) != EMPTY_SLOT) { return (int)*(bdd_table + slot); }
+    if (bdd_old_table != NULL) {
+        slot = bdd_probe(bdd_old_table, bdd_old_mask, key);
+        if (slot != -1 && *(bdd_old_table + slot) != EMPTY_SLOT) { return (int)*(bdd_old_table + slot); }
+    }
+    return -1;
+}
+
+// Put a node that is known to be absent into the unique table.
+static int bdd_hash_insert(int index) {
+    if (2 * (bdd_table_count + 1) > bdd_table_mask + 1 && bdd_table_grow() == -1) { return -1; }
+    *(bdd_table + bdd_probe(bdd_table, bdd_table_mask, NODE_KEY(NODE(index)))) = (uint32_t)index;
+    bdd_table_count++;
+    bdd_rehash_step(BDD_REHASH_STEP);
+    return 0;
+}
+
+/*
+ * Remove the node at the given index from the unique table.
+ * Later members of the probe run are shifted back into the hole (rather than leaving a
+ * tombstone) so that lookups can keep stopping at the first empty slot.
+ */
+static void bdd_hash_remove(int index) {
+    if (bdd_table == NULL) { return; }
+    bdd_rehash_step(bdd_old_mask + 1); // deletion only understands a single table.
+
+    // Find the slot holding this exact node by walking its probe run.
+    int hole = (int)(bdd_hash(NODE_KEY(NODE(index))) & bdd_table_mask);
+    while (*(bdd_table + hole) != (uint32_t)index) {
+        if (*(bdd_table + hole) == EMPTY_SLOT) { return; } // not in the table.
+        hole = (hole + 1) & bdd_table_mask;
+    }
+
+    int next = hole;
+    for (;;) {
+        next = (next + 1) & bdd_table_mask;
+        uint32_t moving = *(bdd_table + next);
+        if (moving == EMPTY_SLOT) { break; }
+
+        // An entry may fill the hole only if its home slot doesn't lie cyclically in (hole, next].
+        int home = (int)(bdd_hash(NODE_KEY(NODE(moving))) & bdd_table_mask);
+        int stays = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!stays) {
+            *(bdd_table + hole) = moving;
+            hole = next;
+        }
+    }
+    *(bdd_table + hole) = EMPTY_SLOT;
+    bdd_table_count--;
+}
 
 /**
  * Look up, in the node table, a BDD node having the specified level and children,
@@ -42,87 +329,332 @@ int freeSpot() {
 int bdd_lookup(int level, int left, int right) {
 
     // Out of range args
-    if (left >= BDD_NODES_MAX || right >= BDD_NODES_MAX || level > BDD_LEVELS_MAX) { return -1; }
+    if (level < 0 || level > BDD_LEVELS_MAX) { return -1; }
+    if (left < 0 || right < 0 || left >= BDD_NODES_LIMIT || right >= BDD_NODES_LIMIT) { return -1; }
 
     // left and right children are the same, so we just return the index of the child since this node is useless.
     if (left == right) { return left; }
 
-    // otherwise we need to search the hashtable to see if there's a node with these attributes.
-    int hash = 0;
-    // Our hash function will be key = (LEFT * RIGHT) % 2097169, which is BDD_HASH_SIZE. Collisions will be dealt with using linear probing.
+    if (bdd_table == NULL && bdd_hash_reset() == -1) { return -1; }
 
-    hash = (left * right) % BDD_HASH_SIZE;
-    //debug("%i hash\n", hash);
-    //debug("%p pointer\n", *(bdd_hash_map + hash));
+    // Check the current table, then whatever hasn't been copied out of the old one yet.
+    int found = bdd_hash_find(PACK(level, left, right));
+    if (found != -1) { return found; }
 
-    // Check if this hash is in the map.
-    if (*(bdd_hash_map + hash) != NULL) {
+    // The node doesn't exist yet, so create it.
+    int newIndex = bdd_node_alloc();
+    if (newIndex == -1) { return -1; }
+
+    BDD_NODE newNode = {level, left, right};
+    *NODE(newIndex) = newNode;
+    if (bdd_hash_insert(newIndex) == -1) {
+        bdd_node_free(newIndex);
+        return -1;
+    }
+    return newIndex;
+}
 
-        for (int i = hash; i < BDD_HASH_SIZE; i++) {
-            if (*(bdd_hash_map + i) == NULL) { break; } // Not in the hash table.
+/*
+ * Concurrent construction.
+ * Between bdd_concurrent_begin() and bdd_concurrent_end(), any number of threads may call
+ * bdd_lookup_concurrent() at once, as long as nothing else touches the node or unique table.
+ * begin() sizes the unique table and commits node storage for the promised number of new
+ * nodes up front, so neither has to grow while threads are inside. A new node is built in a
+ * slot claimed with an atomic bump and published with a compare-and-swap on its unique-table
+ * slot. A thread that loses that race looks at the winner: if it holds the same triple, its
+ * index is returned and the loser's node goes onto the free list, so every thread gets the
+ * same index for the same triple. No thread ever waits for another.
+ */
+static int bdd_concurrent_limit = 0; // Ceiling for the bump pointer inside a concurrent section, else 0.
+
+// Give back a node that was never published. Pushes onto the free list are safe to race.
+static void bdd_node_free_concurrent(int index) {
+    BDD_NODE *np = NODE(index);
+    (*np).level = FREE_LEVEL;
+    int head = __atomic_load_n(&bdd_free_list, __ATOMIC_RELAXED);
+    do {
+        (*np).left = head;
+        (*np).right = head;
+    } while (!__atomic_compare_exchange_n(&bdd_free_list, &head, index, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-            BDD_NODE *current = *(bdd_hash_map + i);
-            if ((*current).left == left && (*current).right == right && (*current).level == level) {
-                // We found the matching node. Now to find its index.
-                for (int j = 0; j < BDD_NODES_MAX; j++) {
-                    BDD_NODE *toCompare = bdd_nodes + j;
-                    if ((*toCompare).left == left && (*toCompare).right == right && (*toCompare).level == level) { return j;}
-                }
+/*
+ * Start a concurrent section in which at most the given number of nodes will be created.
+ * Returns 0 on success and -1 if the table or node storage could not be made large enough.
+ */
+int bdd_concurrent_begin(int nodes) {
+    if (nodes < 0 || bdd_concurrent_limit != 0) { return -1; }
+    if (nodes > BDD_NODES_LIMIT - bdd_bump_index) { nodes = BDD_NODES_LIMIT - bdd_bump_index; }
+    if (bdd_table == NULL && bdd_hash_reset() == -1) { return -1; }
+
+    // Probing threads only understand a single table, kept at most half full.
+    bdd_rehash_step(bdd_old_mask + 1);
+    while (2 * ((int64_t)bdd_table_count + nodes) > (int64_t)bdd_table_mask + 1) {
+        if (bdd_table_grow() == -1) { return -1; }
+        bdd_rehash_step(bdd_old_mask + 1);
+    }
+
+    int limit = bdd_bump_index + nodes;
+    if (limit > BDD_NODES_MAX && bdd_ext_commit(limit) == -1) { return -1; }
+    bdd_concurrent_limit = limit;
+    return 0;
+}
+
+// End a concurrent section. The caller must have joined every thread that was inside it.
+void bdd_concurrent_end() {
+    if (bdd_concurrent_limit == 0) { return; }
+    if (bdd_bump_index > bdd_concurrent_limit) {
+        bdd_bump_index = bdd_concurrent_limit; // claims that overran the reservation built nothing.
+    }
+    bdd_concurrent_limit = 0;
+}
+
+/**
+ * bdd_lookup() for use by many threads at once inside a concurrent section; outside of one,
+ * it is bdd_lookup(). Returns -1 on bad arguments or once the section's reservation is used up.
+ */
+int bdd_lookup_concurrent(int level, int left, int right) {
+    if (bdd_concurrent_limit == 0) { return bdd_lookup(level, left, right); }
+
+    if (level < 0 || level > BDD_LEVELS_MAX) { return -1; }
+    if (left < 0 || right < 0 || left >= BDD_NODES_LIMIT || right >= BDD_NODES_LIMIT) { return -1; }
+    if (left == right) { return left; }
+
+    uint64_t key = PACK(level, left, right);
+    int created = -1; // our candidate node, built the first time an empty slot is seen.
+    int slot = (int)(bdd_hash(key) & bdd_table_mask);
+    for (int probes = 0; probes <= bdd_table_mask; probes++) {
+        uint32_t index = __atomic_load_n(bdd_table + slot, __ATOMIC_ACQUIRE);
+
+        if (index == EMPTY_SLOT) {
+            if (created == -1) {
+                created = __atomic_fetch_add(&bdd_bump_index, 1, __ATOMIC_RELAXED);
+                if (created >= bdd_concurrent_limit) { return -1; }
+                BDD_NODE newNode = {level, left, right};
+                *NODE(created) = newNode;
             }
+            // Publishing releases the node's fields to every thread that later loads the slot.
+            if (__atomic_compare_exchange_n(bdd_table + slot, &index, (uint32_t)created, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                __atomic_fetch_add(&bdd_table_count, 1, __ATOMIC_RELAXED);
+                return created;
+            }
+            // Another thread filled the slot first; index now holds its node.
         }
 
-        // We need to wrap around.
-        for (int i = 0; i < BDD_HASH_SIZE; i++) {
-            if (*(bdd_hash_map + i) == NULL) { break; } // Not in the hash table.
+        if (NODE_KEY(NODE(index)) == key) {
+            if (created != -1) { bdd_node_free_concurrent(created); }
+            return (int)index;
+        }
+        slot = (slot + 1) & bdd_table_mask;
+    }
 
-            BDD_NODE *current = *(bdd_hash_map + i);
-            if ((*current).left == left && (*current).right == right && (*current).level == level) {
-                // We found the matching node. Now to find its index.
-                for (int j = 0; j < BDD_NODES_MAX; j++) {
-                    BDD_NODE *toCompare = bdd_nodes + j;
-                    if ((*toCompare).left == left && (*toCompare).right == right && (*toCompare).level == level) { return j;}
-                }
-            }
+    if (created != -1) { bdd_node_free_concurrent(created); }
+    return -1;
+}
+
+/*
+ * Computed table.
+ * A direct-mapped, lossy cache of the results of the recursive transforms, keyed by
+ * (operation, parameter, node) in the style of CUDD. Hash-consing gives a subgraph that
+ * is reachable along many paths a single index, so one hit replaces a re-walk of the
+ * whole subgraph and a transform costs time proportional to the number of nodes rather
+ * than the number of paths. Entries hold node indices, so anything that frees or
+ * renumbers nodes, or empties the unique table, flushes the cache. Entries are stamped
+ * with the epoch they were stored in and a flush just starts a new epoch, so flushing
+ * costs nothing however large the cache has grown.
+ */
+#define OP_MAP 1
+#define OP_ROTATE 2
+#define OP_ZOOM_IN 3
+#define OP_ZOOM_OUT 4
+#define OP_NONZERO 5
+#define OP_RANGE 6
+#define OP_DISTANCE 7
+#define OP_APPROXIMATE 8
+
+#define CACHE_KEY(op, param, index) (((uint64_t)(op) << 56) | ((uint64_t)((param) & 0xFFFFFF) << 32) | (uint32_t)(index))
+// Operations on two nodes take both indices instead, which fit below BDD_NODES_LIMIT.
+#define PAIR_KEY(op, a, b) (((uint64_t)(op) << 56) | ((uint64_t)(a) << 28) | (uint32_t)(b))
+#define BDD_CACHE_MIN (1 << 12)
+#define BDD_CACHE_MAX (1 << 20)
+
+typedef struct bdd_cache_entry {
+    uint64_t key;
+    uint32_t epoch; // Entries from earlier epochs are empty; epoch 0 is never current.
+    int result;
+} BDD_CACHE_ENTRY;
+
+static BDD_CACHE_ENTRY *bdd_cache = NULL;
+static int bdd_cache_mask = -1;
+static uint32_t bdd_cache_epoch = 1;
+static int bdd_map_serial = 0; // Tags the entries of each bdd_map() call; see bdd_map().
+
+static void bdd_cache_flush() {
+    bdd_cache_epoch++;
+    if (bdd_cache_epoch == 0) { // wrapped: stamps from 2^32 flushes ago would look current.
+        if (bdd_cache != NULL) {
+            memset(bdd_cache, 0, (size_t)(bdd_cache_mask + 1) * sizeof(BDD_CACHE_ENTRY));
         }
+        bdd_cache_epoch = 1;
     }
+}
 
-    // The hash is NOT in the map, we can make a new node.
-    BDD_NODE newNode = {level, left, right};
-    //debug("%c\n", newNode.level + 64);
-    //debug("NEW NODE: %i level (%c letter), %i left, %i right, %i nodeNum\n", newNode.level, newNode.level + 64, newNode.left, newNode.right, freespot()); // not index - 1 bc havent incremented yet
-    //debug("%p newnode ptr\n", &newNode);
+// Size the cache for a BDD of the given node count. Without memory the transforms still work, uncached.
+static void bdd_cache_reserve(int nodes) {
+    int size = BDD_CACHE_MIN;
+    while (size < nodes && size < BDD_CACHE_MAX) { size *= 2; }
+    if (size <= bdd_cache_mask + 1) { return; }
+
+    BDD_CACHE_ENTRY *grown = calloc(size, sizeof(BDD_CACHE_ENTRY));
+    if (grown == NULL) { return; }
+    free(bdd_cache);
+    bdd_cache = grown;
+    bdd_cache_mask = size - 1;
+}
+
+// The cached result for a key, or -1 on a miss.
+static int bdd_cache_find(uint64_t key) {
+    if (bdd_cache == NULL) { return -1; }
+    BDD_CACHE_ENTRY *entry = bdd_cache + (bdd_hash(key) & bdd_cache_mask);
+    return (*entry).key == key && (*entry).epoch == bdd_cache_epoch ? (*entry).result : -1;
+}
 
-    int freeSpotIndex = freeSpot();
-    if(freeSpotIndex == -1) return -1;
-    //debug("%i\n", freeSpotIndex);
-    *(bdd_nodes + freeSpotIndex) = newNode; // Insert new node into the table.
+// Remember a result, evicting whatever shared its slot. Failures (-1) are never cached.
+static int bdd_cache_store(uint64_t key, int result) {
+    if (bdd_cache != NULL && result >= 0) {
+        BDD_CACHE_ENTRY *entry = bdd_cache + (bdd_hash(key) & bdd_cache_mask);
+        (*entry).key = key;
+        (*entry).epoch = bdd_cache_epoch;
+        (*entry).result = result;
+    }
+    return result;
+}
 
-    // Space found so insert into hash table.
-    if (*(bdd_hash_map + hash) == NULL) {
-        *(bdd_hash_map + hash) = bdd_nodes + freeSpotIndex;
-        return freeSpotIndex;
+/*
+ * Garbage collection.
+ * Callers register the addresses of the BDD_NODE pointers they want to keep alive.
+ * bdd_gc() marks everything reachable from those roots, then sweeps every other allocated
+ * node out of the unique table and back to the allocator. With compaction requested,
+ * survivors are also renumbered into [BDD_NUM_LEAVES, BDD_NUM_LEAVES + live) and the
+ * registered pointers are rewritten, so the high-water mark drops back to the live set.
+ */
+static BDD_NODE ***bdd_gc_roots = NULL;
+static int bdd_gc_root_count = 0;
+static int bdd_gc_root_capacity = 0;
+
+// Keep the BDD that *root points to alive across bdd_gc(). Returns 0, or -1 if out of memory.
+int bdd_gc_register_root(BDD_NODE **root) {
+    if (root == NULL) { return -1; }
+    if (bdd_gc_root_count == bdd_gc_root_capacity) {
+        int capacity = bdd_gc_root_capacity == 0 ? 16 : 2 * bdd_gc_root_capacity;
+        BDD_NODE ***grown = realloc(bdd_gc_roots, capacity * sizeof(BDD_NODE **));
+        if (grown == NULL) { return -1; }
+        bdd_gc_roots = grown;
+        bdd_gc_root_capacity = capacity;
     }
+    *(bdd_gc_roots + bdd_gc_root_count) = root;
+    bdd_gc_root_count++;
+    return 0;
+}
 
-    // Collision at hash
-    else {
-        //debug("Collision at hash\n");
-        for (int i = hash; i < BDD_HASH_SIZE; i++) {
-            if (*(bdd_hash_map + i) == NULL) {
-                *(bdd_hash_map + i) = bdd_nodes + freeSpotIndex;
-                return freeSpotIndex;
-            }
+// Stop treating *root as live.
+void bdd_gc_unregister_root(BDD_NODE **root) {
+    for (int i = 0; i < bdd_gc_root_count; i++) {
+        if (*(bdd_gc_roots + i) == root) {
+            bdd_gc_root_count--;
+            *(bdd_gc_roots + i) = *(bdd_gc_roots + bdd_gc_root_count);
+            return;
         }
     }
-    //debug("Wrapping around\n");
-    // Wrap around
-    for (int i = 0; i < BDD_HASH_SIZE; i++) {
-        if (*(bdd_hash_map + i) == NULL) {
-            *(bdd_hash_map + i) = bdd_nodes + freeSpotIndex;
-            return freeSpotIndex;
-        }
+}
+
+// Mark the subgraph under index. Recursion only follows left children, so depth is bounded by the level.
+static void bdd_gc_mark(int index, unsigned char *marks, int limit) {
+    while (index >= BDD_NUM_LEAVES && index < limit && *(marks + index) == 0) {
+        *(marks + index) = 1;
+        bdd_gc_mark(NODE(index)->left, marks, limit);
+        index = NODE(index)->right;
     }
+}
 
-    return -1; // Error somewhere with the args that wasn't spotted earlier.
+// Forwarding address of a node during compaction. Indices past the limit were never ours to move.
+#define FORWARD(i) ((i) < limit ? *(forward + (i)) : (i))
+
+// Slide the marked nodes down to the bottom of the table and rewrite every reference to them.
+static int bdd_gc_compact(unsigned char *marks, int limit) {
+    int *forward = malloc(limit * sizeof(int));
+    if (forward == NULL) { return -1; }
+
+    int next = BDD_NUM_LEAVES;
+    for (int i = 0; i < limit; i++) {
+        if (i < BDD_NUM_LEAVES) { *(forward + i) = i; }
+        else if (*(marks + i)) { *(forward + i) = next++; }
+    }
+
+    // Every entry of the unique table is about to move, so rebuild it from scratch.
+    bdd_hash_reset();
+
+    // New indices never exceed old ones, so an ascending pass never overwrites a survivor.
+    // Survivors can share a key, since bdd_hash_reset() leaves earlier nodes alive; only the
+    // first of them goes into the table, which then holds one node per key as lookups expect.
+    for (int i = BDD_NUM_LEAVES; i < limit; i++) {
+        if (!*(marks + i)) { continue; }
+        BDD_NODE *from = NODE(i);
+        BDD_NODE moved = {(*from).level, FORWARD((*from).left), FORWARD((*from).right)};
+        *NODE(FORWARD(i)) = moved;
+        if (bdd_hash_find(NODE_KEY(&moved)) == -1) { bdd_hash_insert(FORWARD(i)); }
+    }
+
+    // Everything above the survivors goes back to never-used, index-map entries included.
+    BDD_NODE unused = {0, 0, 0};
+    for (int i = next; i < limit; i++) {
+        *NODE(i) = unused;
+        *INDEX_MAP(i) = 0;
+    }
+    bdd_bump_index = next;
+    bdd_free_list = -1;
+
+    for (int i = 0; i < bdd_gc_root_count; i++) {
+        BDD_NODE **root = *(bdd_gc_roots + i);
+        if (*root != NULL) { *root = NODE(FORWARD(INDEX(*root))); }
+    }
+
+    free(forward);
+    return 0;
+}
+
+/*
+ * Reclaim every node not reachable from a registered root. If compact is nonzero, also
+ * renumber the survivors densely (see above). Returns the number of nodes reclaimed, or -1
+ * if scratch memory could not be obtained (in which case the table is left untouched).
+ */
+int bdd_gc(int compact) {
+    int limit = bdd_bump_index;
+    unsigned char *marks = calloc(limit, sizeof(unsigned char));
+    if (marks == NULL) { return -1; }
+
+    for (int i = 0; i < bdd_gc_root_count; i++) {
+        BDD_NODE *root = *(*(bdd_gc_roots + i));
+        if (root != NULL) { bdd_gc_mark(INDEX(root), marks, limit); }
+    }
+
+    bdd_cache_flush(); // entries may name nodes that are about to be freed or moved.
+    int reclaimed = 0;
+    for (int i = BDD_NUM_LEAVES; i < limit; i++) {
+        if (*(marks + i) || NODE(i)->level == FREE_LEVEL) { continue; }
+        bdd_hash_remove(i);
+        bdd_node_free(i);
+        reclaimed++;
+    }
+
+    if (compact && bdd_gc_compact(marks, limit) == -1) {
+        free(marks);
+        return -1;
+    }
+
+    free(marks);
+    return reclaimed;
 }
 
 int power(int base, int raise) {
@@ -148,423 +680,1306 @@ int bdd_min_level(int w, int h) {
     return l;
 }
 
-// 0 is row split, 1 is col.
-int recursiveBddBuilder(int level, int split, int sizeR, int sizeC, int topLeftR, int topLeftC,  int ogWidth, int ogHeight, unsigned char *raster) {
+/*
+ * Raster to BDD, bottom-up.
+ * A block of the raster is reduced one level at a time, in place, in a buffer of node
+ * indices: odd levels merge horizontally adjacent pairs (the column bit) and even levels
+ * vertically adjacent ones (the row bit), halving the width and height in turn until a
+ * single root is left. A pair of equal halves is the half itself and needs no lookup, so
+ * each pass first compares a vector of pairs at once and only falls back to bdd_lookup for
+ * the lanes that differ; flat regions go through at vector speed. Anything past the edge of
+ * the raster is black padding, which is never stored.
+ */
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int64_t v2di __attribute__((vector_size(16)));
+
+#define BDD_TILE_LEVEL 8 // Level of the largest block built straight from its pixels.
+#define BDD_TILE_SIDE 16 // A tile row is one vector of pixels, so even tiles use the vector merges.
+
+// Whether every lane of a vector comparison came out true, i.e. all 128 bits are set.
+#define ALL_TRUE(cmp) bdd_all_ones((v2di)(cmp))
+
+static inline int bdd_all_ones(v2di bits) {
+    uint64_t low, high;
+    memcpy(&low, &bits, sizeof(low));
+    memcpy(&high, (unsigned char *)&bits + sizeof(low), sizeof(high));
+    return (low & high) == UINT64_MAX;
+}
+
+/*
+ * Posterization.
+ * With a leaf map set, every pixel is looked up in it as the builder first reads it, so a
+ * raster is quantized on its way into the leaves without a pass of its own. The map is only
+ * read during a build, so parallel builds share it.
+ */
+static unsigned char *bdd_leaf_map = NULL;
+
+/**
+ * Make bdd_from_raster() quantize pixels to the given number of evenly spaced gray levels,
+ * from 2 to 255, black and white included. Anything else builds from the pixels as they are.
+ * Returns 0, or -1 without memory for the map, which leaves pixels as they are.
+ */
+int bdd_set_posterize(int levels) {
+    free(bdd_leaf_map);
+    bdd_leaf_map = NULL;
+    if (levels < 2 || levels > 255) { return 0; }
+    if ((bdd_leaf_map = malloc(BDD_NUM_LEAVES)) == NULL) { return -1; }
+    for (int value = 0; value < BDD_NUM_LEAVES; value++) {
+        int step = value * levels / BDD_NUM_LEAVES; // which of the levels value falls in.
+        *(bdd_leaf_map + value) = (step * 255 + (levels - 1) / 2) / (levels - 1);
+    }
+    return 0;
+}
+
+// The leaf a pixel becomes.
+static inline int bdd_leaf(unsigned char value) {
+    return bdd_leaf_map == NULL ? value : *(bdd_leaf_map + value);
+}
+
+// Merge two halves into a node at the given level. Safe to run on many threads at once.
+static inline int bdd_pair(int level, int left, int right) {
+    return left == right ? left : bdd_lookup_concurrent(level, left, right);
+}
 
-    if (level == 0) {
-        // get color.
-        // outside original raster
-        if (topLeftR >= ogHeight || topLeftC >= ogWidth) {
-            return 0;
+// Level 1: merge horizontal pairs of pixels into the buffer, width pixels wide, height rows high.
+static void bdd_merge_pixels(unsigned char *raster, int stride, int width, int height, int *out) {
+    int pairs = width / 2;
+    int outWidth = (width + 1) / 2;
+    for (int r = 0; r < height; r++) {
+        unsigned char *row = raster + (size_t)r * stride;
+        int *dst = out + (size_t)r * outWidth;
+        int c = 0;
+        for (; c + 8 <= pairs; c += 8) {
+            v16qu px;
+            memcpy(&px, row + 2 * c, sizeof(px));
+            v16qu swapped = __builtin_shuffle(px, (v16qu){1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14});
+            int flat = ALL_TRUE(px == swapped); // pixels that are equal stay equal through the leaf map.
+            for (int i = 0; i < 8; i++) {
+                unsigned char *pair = row + 2 * (c + i);
+                *(dst + c + i) = flat ? bdd_leaf(*pair) : bdd_pair(1, bdd_leaf(*pair), bdd_leaf(*(pair + 1)));
+            }
         }
-        else {
-            //debug("(%i,%i) R,C with color %i\n", topLeftR, topLeftC, *(raster + (topLeftR * ogWidth) + topLeftC));
-            //debug("COLOR NODE HIT AT: (%i, %i)\n", topLeftR, topLeftC);
-            return *(raster + (topLeftR * ogWidth) + topLeftC);
+        for (; c < pairs; c++) {
+            *(dst + c) = bdd_pair(1, bdd_leaf(*(row + 2 * c)), bdd_leaf(*(row + 2 * c + 1)));
         }
+        if (width % 2) { *(dst + pairs) = bdd_pair(1, bdd_leaf(*(row + width - 1)), 0); }
     }
+}
 
-    else {
-
-        int left;
-        int right;
+// Odd level above 1: merge horizontal pairs of the buffer in place.
+static void bdd_merge_columns(int level, int *buffer, int width, int height) {
+    int pairs = width / 2;
+    int outWidth = (width + 1) / 2;
+    for (int r = 0; r < height; r++) {
+        int *src = buffer + (size_t)r * width;
+        int *dst = buffer + (size_t)r * outWidth; // never ahead of what is still to be read.
+        int c = 0;
+        for (; c + 4 <= pairs; c += 4) {
+            v4si a, b;
+            memcpy(&a, src + 2 * c, sizeof(a));
+            memcpy(&b, src + 2 * c + 4, sizeof(b));
+            v4si lefts = __builtin_shuffle(a, b, (v4si){0, 2, 4, 6});
+            v4si rights = __builtin_shuffle(a, b, (v4si){1, 3, 5, 7});
+            if (ALL_TRUE(lefts == rights)) {
+                memcpy(dst + c, &lefts, sizeof(lefts));
+                continue;
+            }
+            // Pair by pair from the buffer: a pair is always read before its result lands on it.
+            for (int i = c; i < c + 4; i++) {
+                *(dst + i) = bdd_pair(level, *(src + 2 * i), *(src + 2 * i + 1));
+            }
+        }
+        for (; c < pairs; c++) {
+            *(dst + c) = bdd_pair(level, *(src + 2 * c), *(src + 2 * c + 1));
+        }
+        if (width % 2) { *(dst + pairs) = bdd_pair(level, *(src + width - 1), 0); }
+    }
+}
 
-        if (split == 0) {
-            left = recursiveBddBuilder(level - 1, 1, sizeR / 2, sizeC, topLeftR, topLeftC, ogWidth, ogHeight, raster); // coords dont change if we go left.
+// Even level: merge vertical pairs of the buffer in place.
+static void bdd_merge_rows(int level, int *buffer, int width, int height) {
+    for (int r = 0; r < (height + 1) / 2; r++) {
+        int *top = buffer + (size_t)(2 * r) * width;
+        int *bottom = top + width;
+        int *dst = buffer + (size_t)r * width;
+        if (2 * r + 1 == height) { // the bottom half is padding.
+            for (int c = 0; c < width; c++) { *(dst + c) = bdd_pair(level, *(top + c), 0); }
+            continue;
         }
-        else {
-            left = recursiveBddBuilder(level - 1, 0, sizeR, sizeC / 2, topLeftR, topLeftC, ogWidth, ogHeight, raster); // coords dont change if we go left.
+        int c = 0;
+        for (; c + 4 <= width; c += 4) {
+            v4si a, b;
+            memcpy(&a, top + c, sizeof(a));
+            memcpy(&b, bottom + c, sizeof(b));
+            if (ALL_TRUE(a == b)) {
+                memcpy(dst + c, &a, sizeof(a));
+                continue;
+            }
+            for (int i = c; i < c + 4; i++) {
+                *(dst + i) = bdd_pair(level, *(top + i), *(bottom + i));
+            }
         }
+        for (; c < width; c++) {
+            *(dst + c) = bdd_pair(level, *(top + c), *(bottom + c));
+        }
+    }
+}
 
-        // when going right: if row choice, row coordinate increases by currentrowsize / 2. if col choice, col coord increases by currentcolsize / 2
-        // go right while splitting row. next call will split the opposite so we pass the opposite.
-        if (split == 0) {
-            right = recursiveBddBuilder(level - 1, 1, sizeR / 2, sizeC, topLeftR + (sizeR / 2), topLeftC, ogWidth, ogHeight, raster);
+// Merge levels first + 1 through last of a buffer that is width by height at level first.
+static void bdd_merge_levels(int first, int last, int *buffer, int width, int height) {
+    for (int l = first + 1; l <= last; l++) {
+        if (l % 2 == 0) {
+            bdd_merge_rows(l, buffer, width, height);
+            height = (height + 1) / 2;
         }
-        // split col
         else {
-            right = recursiveBddBuilder(level - 1, 0, sizeR, sizeC / 2, topLeftR, topLeftC + (sizeC / 2), ogWidth, ogHeight, raster);
+            bdd_merge_columns(l, buffer, width, height);
+            width = (width + 1) / 2;
         }
-
-        return bdd_lookup(level, left, right);
     }
 }
 
-BDD_NODE *bdd_from_raster(int w, int h, unsigned char *raster) {
+// Scratch for one tile's build, BDD_TILE_SIDE pixels square merged to half as many pairs.
+#define BDD_TILE_SCRATCH (BDD_TILE_SIDE * BDD_TILE_SIDE / 2)
 
-    // Initialize hashmap.
-    for (int i = 0; i < BDD_HASH_SIZE; i++) {
+// Build a block of at most BDD_TILE_SIDE pixels square straight from its pixels, in scratch.
+static int bdd_build_tile(int level, unsigned char *origin, int stride, int width, int height, int *scratch) {
+    bdd_merge_pixels(origin, stride, width, height, scratch);
+    bdd_merge_levels(1, level, scratch, (width + 1) / 2, height);
+    return *scratch;
+}
 
-        *(bdd_hash_map + i) = NULL;
+/*
+ * Tile cache.
+ * Scans and textures repeat whole tiles, and a repeated non-uniform tile would otherwise
+ * cost a lookup for every differing pair of its pixels before hash-consing found the node it
+ * already has. So full tiles are hashed first, and a tile whose pixels match a cached one
+ * takes that tile's root outright. Entries point back at their tile in the raster, so a hash
+ * collision is caught by comparing pixels rather than trusted. The cache is direct-mapped and
+ * lossy, and belongs to one bdd_build_block() call, which keeps parallel tasks apart.
+ */
+#define BDD_TILE_CACHE_MAX (1 << 16)
+
+typedef struct bdd_tile_entry {
+    uint64_t hash;
+    unsigned char *source; // Top left pixel of the cached tile, or NULL when empty.
+    int root;
+} BDD_TILE_ENTRY;
+
+static uint64_t bdd_tile_hash(unsigned char *origin, int stride) {
+    uint64_t hash = 0;
+    for (int r = 0; r < BDD_TILE_SIDE; r++) {
+        unsigned char *row = origin + (size_t)r * stride;
+        for (int c = 0; c < BDD_TILE_SIDE; c += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, row + c, sizeof(word));
+            hash = bdd_hash(hash ^ word);
+        }
     }
-    if (w < 0 || h < 0) { return NULL;} // invalid
-
-    // function returns 2d.
-    int levels = bdd_min_level(w, h); // this is the number of levels, or 2d.
-    int d = levels / 2; // this is d.
-    int dimensions =  power(2, d); // the dimensions are 2^d by 2^d now.
-    //debug("%i d, %i w, %i h\n", d, w, h);
-    //debug("%i levels, %i dimensions, %i d\n", levels, dimensions, d);
-    int root = recursiveBddBuilder(levels, 0, dimensions, dimensions, 0, 0, w, h, raster);
-    return (bdd_nodes + root);
+    return hash;
+}
 
+static int bdd_tile_equal(unsigned char *a, unsigned char *b, int stride) {
+    for (int r = 0; r < BDD_TILE_SIDE; r++) {
+        if (memcmp(a + (size_t)r * stride, b + (size_t)r * stride, BDD_TILE_SIDE) != 0) { return 0; }
+    }
+    return 1;
 }
 
-void bdd_to_raster(BDD_NODE *node, int w, int h, unsigned char *raster) {
+// Build a full tile through the cache, which may be NULL.
+static int bdd_build_cached_tile(BDD_TILE_ENTRY *cache, int mask, unsigned char *origin, int stride, int *scratch) {
+    if (cache == NULL) { return bdd_build_tile(BDD_TILE_LEVEL, origin, stride, BDD_TILE_SIDE, BDD_TILE_SIDE, scratch); }
 
-    int offset;
-    unsigned char returned;
-    for (int i = 0; i < h; i++) {
-        for (int j = 0; j < w; j++) {
-            offset = (i *w) + j;
-            returned = bdd_apply(node, i, j);
-            //debug("%i ", returned);
-            *(raster + offset) = returned;
-        }
-        //debug("\n");
+    uint64_t hash = bdd_tile_hash(origin, stride);
+    BDD_TILE_ENTRY *entry = cache + (hash & mask);
+    if ((*entry).source != NULL && (*entry).hash == hash && bdd_tile_equal((*entry).source, origin, stride)) {
+        return (*entry).root;
     }
+
+    int root = bdd_build_tile(BDD_TILE_LEVEL, origin, stride, BDD_TILE_SIDE, BDD_TILE_SIDE, scratch);
+    if (root >= 0) {
+        (*entry).hash = hash;
+        (*entry).source = origin;
+        (*entry).root = root;
+    }
+    return root;
 }
 
-// Converts given serial numbers to their proper representation and writes them to out.
-void writeSerialize(int left, int right, int level, FILE *out) {
-    //debug("%c level, %i left, %i right\n", level,left, right);
-    //debug("LEFT IN OCTAL: %i\n\n", left);
+/*
+ * Build the square block of the given (even) level whose top left pixel is at
+ * (topLeftR, topLeftC) of a w by h raster. Returns the index of its root, or -1 if
+ * memory or the node table ran out. Blocks larger than a tile are built tile by tile,
+ * and the tiles' roots then merged up to the block's.
+ */
+static int bdd_build_block(int level, int topLeftR, int topLeftC, int w, int h, unsigned char *raster) {
+    int side = 1 << (level / 2);
+    int width = w - topLeftC < side ? w - topLeftC : side;
+    int height = h - topLeftR < side ? h - topLeftR : side;
+    if (width <= 0 || height <= 0) { return 0; } // all padding.
+
+    unsigned char *origin = raster + (size_t)topLeftR * w + topLeftC;
+    if (level == 0) { return bdd_leaf(*origin); }
+    int *scratch = malloc(BDD_TILE_SCRATCH * sizeof(int));
+    if (scratch == NULL) { return -1; }
+    if (level <= BDD_TILE_LEVEL) {
+        int root = bdd_build_tile(level, origin, w, width, height, scratch);
+        free(scratch);
+        return root;
+    }
+
+    int across = (width + BDD_TILE_SIDE - 1) / BDD_TILE_SIDE;
+    int down = (height + BDD_TILE_SIDE - 1) / BDD_TILE_SIDE;
+    int *buffer = malloc((size_t)across * down * sizeof(int));
+    if (buffer == NULL) {
+        free(scratch);
+        return -1;
+    }
 
+    // Without memory for the cache, tiles are simply built one by one.
+    int size = 1;
+    while (size < across * down && size < BDD_TILE_CACHE_MAX) { size *= 2; }
+    BDD_TILE_ENTRY *cache = calloc(size, sizeof(BDD_TILE_ENTRY));
+
+    for (int tr = 0; tr < down; tr++) {
+        for (int tc = 0; tc < across; tc++) {
+            unsigned char *tile = origin + (size_t)tr * BDD_TILE_SIDE * w + tc * BDD_TILE_SIDE;
+            int tileWidth = width - tc * BDD_TILE_SIDE < BDD_TILE_SIDE ? width - tc * BDD_TILE_SIDE : BDD_TILE_SIDE;
+            int tileHeight = height - tr * BDD_TILE_SIDE < BDD_TILE_SIDE ? height - tr * BDD_TILE_SIDE : BDD_TILE_SIDE;
+            *(buffer + (size_t)tr * across + tc) = tileWidth == BDD_TILE_SIDE && tileHeight == BDD_TILE_SIDE
+                ? bdd_build_cached_tile(cache, size - 1, tile, w, scratch)
+                : bdd_build_tile(BDD_TILE_LEVEL, tile, w, tileWidth, tileHeight, scratch); // cut off by the edge.
+        }
+    }
+    free(cache);
+    free(scratch);
 
-    // convert to little endian.
-    // bytes that go 1/2/3/4 will be stored as 4/3/2/1.
-    int left1 = (left & 0xFF000000) >> 24;
-    int left2 = (left & 0xFF0000) >> 16;
-    int left3 = (left & 0xFF00) >> 8;
-    int left4 = (left & 0xFF);
+    bdd_merge_levels(BDD_TILE_LEVEL, level, buffer, across, down);
+    int root = *buffer;
+    free(buffer);
+    return root;
+}
 
-    int right1 = (right & 0xFF000000) >> 24;
-    int right2 = (right & 0xFF0000) >> 16;
-    int right3 = (right & 0xFF00) >> 8;
-    int right4 = (right & 0xFF);
+/*
+ * Parallel construction.
+ * With more than one thread, bdd_from_raster() cuts the top levels of the tree off and builds
+ * every subtree below the cut as an independent task, inside a concurrent section of the
+ * unique table. Each worker owns a run of tasks in its own deque and works from the front;
+ * a worker whose deque runs dry steals from the back of another's, so uneven quadrants
+ * (detailed ones next to flat ones) still keep every core busy. The levels above the cut are
+ * then joined on the calling thread. Hash-consing makes the result the same node-for-node
+ * as the serial build, whatever the interleaving.
+ */
+#define BDD_THREADS_MAX 64
+#define BDD_TASKS_PER_THREAD 8
+#define BDD_PARALLEL_MIN_LEVEL 12        // Below 64x64 the pool costs more than it saves.
+#define BDD_TASK_MIN_LEVEL 6             // Tasks are at least 8x8.
+#define BDD_PARALLEL_RESERVE (1 << 22)   // Most nodes a concurrent build reserves room for.
+
+static int bdd_thread_count = 1;
+
+typedef struct bdd_deque {
+    pthread_mutex_t lock;
+    int head; // Next task the owner takes.
+    int tail; // One past the next task a thief takes.
+} BDD_DEQUE;
+
+typedef struct bdd_build_job {
+    int level;        // Level of every task's subtree.
+    int size;         // Side of every task's square.
+    int across;       // Tasks per row of the grid.
+    int cut;          // Levels above the tasks.
+    int width;
+    int height;
+    unsigned char *raster;
+    int *results;     // Root index of each task's subtree, in tree order.
+    int workers;
+    BDD_DEQUE *deques;
+} BDD_BUILD_JOB;
+
+typedef struct bdd_worker {
+    BDD_BUILD_JOB *job;
+    int self;
+} BDD_WORKER;
 
-    //debug("integer: %c level, %i/%i/%i/%i and right: %i/%i/%i/%i\n", level, left4, left3, left2, left1, right4, right3, right2, right1);
-    //debug("%c L:%i R:%i\n", level, left, right);
-    //debug(debug"octal: %c/%o/%o/%o/%o and right: %o/%o/%o/%o\n\n", level, left4, left3, left2, left1, right4, right3, right2, right1);
-    //debug("%c%c%c%c%c%c%c%c%c", level, left1, left2, left3, left4, right1, right2, right3, right4);
-    fputc(level, out);
+/**
+ * Set how many threads bdd_from_raster() may use. 1 (the default) builds serially, and
+ * 0 or less means one per online processor.
+ */
+void bdd_set_threads(int threads) {
+    if (threads <= 0) { threads = (int)sysconf(_SC_NPROCESSORS_ONLN); }
+    if (threads < 1) { threads = 1; }
+    if (threads > BDD_THREADS_MAX) { threads = BDD_THREADS_MAX; }
+    bdd_thread_count = threads;
+}
 
-    fputc(left4, out);
-    fputc(left3, out);
-    fputc(left2, out);
-    fputc(left1, out);
+// Take a task from the given worker's deque, from the front or (when stealing) the back. -1 if empty.
+static int bdd_deque_take(BDD_DEQUE *deque, int steal) {
+    int task = -1;
+    pthread_mutex_lock(&(*deque).lock);
+    if ((*deque).head < (*deque).tail) {
+        task = steal ? --(*deque).tail : (*deque).head++;
+    }
+    pthread_mutex_unlock(&(*deque).lock);
+    return task;
+}
 
-    fputc(right4, out);
-    fputc(right3, out);
-    fputc(right2, out);
-    fputc(right1, out);
+/*
+ * Task numbers are tree order: reading a number's bits from the top, each pair picks the
+ * bottom half and then the right half of the square at one row level, so that sibling
+ * subtrees sit next to each other for the join.
+ */
+static void bdd_build_task(BDD_BUILD_JOB *job, int task) {
+    int row = 0;
+    int col = 0;
+    for (int bit = (*job).cut - 2; bit >= 0; bit -= 2) {
+        row = 2 * row + ((task >> (bit + 1)) & 1);
+        col = 2 * col + ((task >> bit) & 1);
+    }
+    *((*job).results + task) = bdd_build_block((*job).level, row * (*job).size, col * (*job).size,
+                                               (*job).width, (*job).height, (*job).raster);
 }
 
-// nodeIndex is the index of currentNode.
-int postorder_write(BDD_NODE *currentNode, int nodeIndex, int *serial, FILE *out) {
+static void *bdd_build_worker(void *arg) {
+    BDD_BUILD_JOB *job = (*(BDD_WORKER *)arg).job;
+    int self = (*(BDD_WORKER *)arg).self;
 
-    // base case is that we hit a color. Write that if it's not already here.
-    if (nodeIndex < 256) {
-        if (*(bdd_index_map + nodeIndex) == 0) {
-            fputc('@', out);
-            fputc(nodeIndex, out);
-            *(bdd_index_map + nodeIndex) = (*serial);
-            (*serial) = (*serial) + 1;
-            return (*serial) - 1;
+    int task;
+    while ((task = bdd_deque_take((*job).deques + self, 0)) != -1) {
+        bdd_build_task(job, task);
+    }
+    // Out of work: steal, starting with the next worker along.
+    for (int i = 1; i < (*job).workers; i++) {
+        BDD_DEQUE *victim = (*job).deques + (self + i) % (*job).workers;
+        while ((task = bdd_deque_take(victim, 1)) != -1) {
+            bdd_build_task(job, task);
         }
-        else { return *(bdd_index_map + nodeIndex);}
     }
+    return NULL;
+}
 
-    // Otherwise we continue w/ the traversal.
-    postorder_write(LEFT(currentNode, (*currentNode).level-1), (*currentNode).left, serial, out);
-    if (*(bdd_index_map + (*currentNode).left) == 0) {
-        *(bdd_index_map + (*currentNode).left) = (*serial);
-        (*serial) = (*serial) + 1;
+/*
+ * Build a raster of 2d = levels levels on the thread pool. Returns the root's index, or -1 if
+ * the build could not be done in parallel, in which case any nodes it did make are already
+ * in the unique table for a serial build to find.
+ */
+static int bdd_parallel_build(int levels, int dimensions, int w, int h, unsigned char *raster) {
+    int workers = bdd_thread_count;
+
+    // Cut an even number of levels, deep enough that every worker has several tasks.
+    int cut = 2;
+    while ((1 << cut) < BDD_TASKS_PER_THREAD * workers && levels - (cut + 2) >= BDD_TASK_MIN_LEVEL) {
+        cut += 2;
+    }
+    int tasks = 1 << cut;
+
+    int *results = malloc(tasks * sizeof(int));
+    BDD_DEQUE *deques = malloc(workers * sizeof(BDD_DEQUE));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    BDD_WORKER *args = malloc(workers * sizeof(BDD_WORKER));
+    if (results == NULL || deques == NULL || threads == NULL || args == NULL) {
+        free(results); free(deques); free(threads); free(args);
+        return -1;
     }
 
-    postorder_write(RIGHT(currentNode, (*currentNode).level-1), (*currentNode).right, serial, out);
-    if (*(bdd_index_map + (*currentNode).right) == 0) {
-        *(bdd_index_map + (*currentNode).right) = (*serial);
-        (*serial) = (*serial) + 1;
+    BDD_BUILD_JOB job = {levels - cut, dimensions >> (cut / 2), 1 << (cut / 2), cut,
+                         w, h, raster, results, workers, deques};
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&(*(deques + i)).lock, NULL);
+        (*(deques + i)).head = (int)((long)tasks * i / workers);
+        (*(deques + i)).tail = (int)((long)tasks * (i + 1) / workers);
+        (*(args + i)).job = &job;
+        (*(args + i)).self = i;
     }
 
-    // write currentNode
-    if (*(bdd_index_map + nodeIndex) == 0) {
-        *(bdd_index_map + nodeIndex) = (*serial);
-        (*serial) = (*serial) + 1;
+    // Reserve room for every position in the tree, within reason. The calling thread is worker 0.
+    int root = -1;
+    int64_t positions = ((int64_t)1 << levels) - 1;
+    if (bdd_concurrent_begin(positions < BDD_PARALLEL_RESERVE ? (int)positions : BDD_PARALLEL_RESERVE) == 0) {
+        int started = 1;
+        while (started < workers && pthread_create(threads + started, NULL, bdd_build_worker, args + started) == 0) {
+            started++;
+        }
+        bdd_build_worker(args);
+        for (int i = 1; i < started; i++) {
+            pthread_join(*(threads + i), NULL);
+        }
+        bdd_concurrent_end();
+
+        // Join siblings pairwise up to the root.
+        int count = tasks;
+        for (int level = levels - cut + 1; level <= levels; level++) {
+            count /= 2;
+            for (int i = 0; i < count; i++) {
+                *(results + i) = bdd_lookup(level, *(results + 2 * i), *(results + 2 * i + 1));
+            }
+        }
+        root = *results;
+    }
 
-        BDD_NODE *toWrite = (bdd_nodes + nodeIndex);
-        int level = (*toWrite).level + 64; // offset to get ascii. lvl 1 = a, so lvl 1 is 1 + 64 (ascii for 'A').
-        int left = (*toWrite).left;
-        int right = (*toWrite).right;
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&(*(deques + i)).lock);
+    }
+    free(results); free(deques); free(threads); free(args);
+    return root;
+}
 
-        // But left and right are improperly indexed, we need to get bdd_index_map + left/right to get the serial.
-        left = *(bdd_index_map + left);
-        right = *(bdd_index_map + right);
+BDD_NODE *bdd_from_raster(int w, int h, unsigned char *raster) {
 
-        // Now we have the info to write.
-        writeSerialize(left, right, level, out);
+    // Initialize hashmap.
+    if (bdd_hash_reset() == -1) { return NULL; }
+    if (w < 0 || h < 0) { return NULL;} // invalid
 
-        return (*serial) - 1;
+    // function returns 2d.
+    int levels = bdd_min_level(w, h); // this is the number of levels, or 2d.
+    int d = levels / 2; // this is d.
+    int dimensions =  power(2, d); // the dimensions are 2^d by 2^d now.
+    //debug("%i d, %i w, %i h\n", d, w, h);
+    //debug("%i levels, %i dimensions, %i d\n", levels, dimensions, d);
+    int root = -1;
+    if (bdd_thread_count > 1 && levels >= BDD_PARALLEL_MIN_LEVEL) {
+        root = bdd_parallel_build(levels, dimensions, w, h, raster);
     }
-    else {
-        return *(bdd_index_map + nodeIndex);
+    if (root < 0) { // serial build, which also finishes a parallel one that ran out of room.
+        root = bdd_build_block(levels, 0, 0, w, h, raster);
     }
+    if (root < 0) { return NULL; } // node table is full.
+    return NODE(root);
 
 }
 
-int bdd_serialize(BDD_NODE *node, FILE *out) {
-    if (node == NULL) { return -1;} // invalid.
-    // Initialize bdd_index_map.
-    for (int i = 0; i < BDD_NODES_MAX; i++) {
-        *(bdd_index_map + i) = 0;
+/*
+ * Tile copying.
+ * Hash-consing means a node renders the same block wherever it appears at a given level, so
+ * once a shared subtree (a glyph, a texture tile) has been drawn in full, later occurrences can
+ * be copied from the raster rather than drawn again. A direct-mapped, lossy table remembers
+ * where each (node, level) was last drawn whole; only the positions are kept, the pixels are
+ * already in the raster. Small blocks are cheaper to redraw than to look up and are left out.
+ */
+#define BDD_COPY_MIN_LEVEL 6          // Only blocks of 8x8 pixels and up are copied.
+#define BDD_COPY_ENTRIES_DEFAULT (1 << 12)
+
+typedef struct bdd_tile_copy {
+    int index; // Node drawn, or 0 when empty (leaves are never recorded).
+    int level;
+    int row;   // Top left pixel of the block it was drawn to.
+    int col;
+} BDD_TILE_COPY;
+
+static int bdd_copy_entries = BDD_COPY_ENTRIES_DEFAULT;
+static BDD_TILE_COPY *bdd_copies = NULL; // The table of the bdd_to_raster() call in progress.
+
+/**
+ * Set how many blocks bdd_to_raster() remembers for copying, rounded down to a power of two.
+ * 0 turns tile copying off, so every block is drawn from its nodes.
+ */
+void bdd_set_tile_cache(int entries) {
+    int size = 0;
+    if (entries > 0) {
+        size = 1;
+        while (size <= entries / 2 && size < (1 << 24)) { size *= 2; }
     }
-    int serialize_serial = 1;
-    int unused_node_index = freeSpot();
-
-    postorder_write(LEFT(node, (*node).level - 1), (*node).left, &serialize_serial, out); // left half
-    postorder_write(RIGHT(node, (*node).level - 1), (*node).right, &serialize_serial, out); // right half
-    //debug("%i\n", serialize_serial);
-    // Manually write root to bdd_index_map if it's not there (seems to be the case most of the time.)
-    // to do that we need the index of the root, and then need to check if it has a serial associated with it. If not, then we add it.
-    /* Determine the index of the root node. Prefer pointer arithmetic when possible. */
-    int rootIndex = -1;
-    if (node >= bdd_nodes && node < bdd_nodes + BDD_NODES_MAX) {
-        rootIndex = (int)(node - bdd_nodes);
-    } else {
-        /* Fallback: search for a matching node among allocated nodes. */
-        for (int i = 0; i < unused_node_index; i++) {
-            BDD_NODE *compare = bdd_nodes + i;
-            if ((*compare).left == (*node).left && (*compare).right == (*node).right && (*compare).level == (*node).level) {
-                rootIndex = i;
-                break;
+    bdd_copy_entries = size;
+}
+
+// The rectangle of the image being decoded, and where its pixels go.
+typedef struct bdd_window {
+    unsigned char *out; // Pixel (y, x) of the image is stored first, rows w apart.
+    int x;
+    int y;
+    int w;
+    int h;
+} BDD_WINDOW;
+
+/*
+ * Fill in the part of the window covered by a node standing at the given level, whose top
+ * left pixel is (row, col) of the image. A block at level 2k is 2^k pixels square, and one
+ * at level 2k+1 is the 2^k by 2^(k+1) half of one; levels the node skips split it into
+ * identical halves. Blocks that miss the window are never entered, and a leaf fills its
+ * share of the window a row at a time, so the work done follows the number of blocks
+ * and the bytes written rather than the number of pixels.
+ */
+static void bdd_fill_block(BDD_NODE *node, int level, int row, int col, BDD_WINDOW *window) {
+    int rows = 1 << (level / 2);
+    int cols = 1 << ((level + 1) / 2);
+    int top = row > (*window).y ? row : (*window).y;
+    int bottom = row + rows < (*window).y + (*window).h ? row + rows : (*window).y + (*window).h;
+    int left = col > (*window).x ? col : (*window).x;
+    int right = col + cols < (*window).x + (*window).w ? col + cols : (*window).x + (*window).w;
+    if (top >= bottom || left >= right) { return; } // outside the window.
+
+    if ((*node).level == 0) {
+        for (int r = top; r < bottom; r++) {
+            memset((*window).out + (size_t)(r - (*window).y) * (*window).w + (left - (*window).x), INDEX(node), right - left);
+        }
+        return;
+    }
+
+    BDD_TILE_COPY *copy = NULL;
+    if (bdd_copies != NULL && level >= BDD_COPY_MIN_LEVEL) {
+        copy = bdd_copies + (bdd_hash(((uint64_t)level << 32) | (uint32_t)INDEX(node)) & (bdd_copy_entries - 1));
+        if ((*copy).index == INDEX(node) && (*copy).level == level) {
+            for (int r = top; r < bottom; r++) {
+                memcpy((*window).out + (size_t)(r - (*window).y) * (*window).w + (left - (*window).x),
+                       (*window).out + (size_t)((*copy).row + r - row - (*window).y) * (*window).w + ((*copy).col + left - col - (*window).x),
+                       right - left);
             }
+            return;
         }
     }
 
-    if (rootIndex < 0) {
-        /* Couldn't determine root index: treat as error. */
-        return -1;
+    // Even levels split the block into top and bottom, odd ones into left and right.
+    if (level % 2 == 0) {
+        bdd_fill_block(LEFT(node, level), level - 1, row, col, window);
+        bdd_fill_block(RIGHT(node, level), level - 1, row + rows / 2, col, window);
+    }
+    else {
+        bdd_fill_block(LEFT(node, level), level - 1, row, col, window);
+        bdd_fill_block(RIGHT(node, level), level - 1, row, col + cols / 2, window);
     }
 
-    if (*(bdd_index_map + rootIndex) == 0) {
-        *(bdd_index_map + rootIndex) = serialize_serial;
-        serialize_serial++;
+    // Only a block drawn whole can be copied from later.
+    if (copy != NULL && top == row && bottom == row + rows && left == col && right == col + cols) {
+        BDD_TILE_COPY drawn = {INDEX(node), level, row, col};
+        *copy = drawn;
     }
+}
 
-    BDD_NODE *toWrite = (bdd_nodes + unused_node_index-1); // get root
-    int level = (*toWrite).level + 64; // offset to get ascii. lvl 1 = a, so lvl 1 is 1 + 64 (ascii for 'A').
-    int left = (*toWrite).left;
-    int right = (*toWrite).right;
+/**
+ * Decode just the w by h rectangle of an image whose top left pixel is (y, x), row y and
+ * column x, into out, which receives w * h pixels a row at a time. Only subtrees that
+ * overlap the rectangle are visited. Returns 0 on success, -1 on bad arguments.
+ */
+int bdd_to_raster_region(BDD_NODE *node, int x, int y, int w, int h, unsigned char *out) {
+    if (node == NULL || out == NULL || x < 0 || y < 0 || w < 0 || h < 0) { return -1; }
+    if ((int64_t)x + w > (1 << (BDD_LEVELS_MAX / 2)) || (int64_t)y + h > (1 << (BDD_LEVELS_MAX / 2))) { return -1; }
+
+    // A root below the level covering the rectangle repeats across it.
+    int level = bdd_min_level(x + w, y + h);
+    if ((*node).level > level) { level = (*node).level + (*node).level % 2; }
+
+    // Without memory for the table, every block is simply drawn.
+    BDD_WINDOW window = {out, x, y, w, h};
+    bdd_copies = bdd_copy_entries > 0 ? calloc(bdd_copy_entries, sizeof(BDD_TILE_COPY)) : NULL;
+    bdd_fill_block(node, level, 0, 0, &window);
+    free(bdd_copies);
+    bdd_copies = NULL;
+    return 0;
+}
 
-    // But left and right are improperly indexed, we need to get bdd_index_map + left/right to get the serial.
-    left = *(bdd_index_map + left);
-    right = *(bdd_index_map + right);
+void bdd_to_raster(BDD_NODE *node, int w, int h, unsigned char *raster) {
+    bdd_to_raster_region(node, 0, 0, w, h, raster);
+}
 
-    // Now we have the info to write.
-    writeSerialize(left, right, level, out);
+/*
+ * Record formats.
+ * B5 files use the records described for bdd_serialize(): an opcode, then a leaf value or two
+ * 4-byte little-endian child serials. B6 files keep the opcodes and leaf values, but give each
+ * child as a LEB128 value: 7 bits a byte, low bits first, with the top bit set on every byte
+ * but the last. The low bit of the value says what the rest is: 0 for the distance back from
+ * the node's own serial, 1 for the child's serial itself, which the writer picks when that is
+ * shorter (the leaves, numbered first, are referred to from all over). Most often the right
+ * child is the record just before the node; then the opcode has its top bit set and only the
+ * left child follows.
+ */
+#define BDD_SERIALIZE_BUFFER (1 << 18) // bytes of records collected before each write.
+#define BDD_RECORD_MAX 11 // an opcode and two serials, of at most 5 bytes in LEB128.
+#define BDD_VARINT_MAX 5
+#define BDD_RIGHT_PREVIOUS 0x80 // B6 opcode flag: the right child is the preceding record.
+
+// Store a serial number as the 4 little-endian bytes a B5 record holds.
+static inline void bdd_store_serial(uint8_t *p, int serial) {
+    uint32_t value = (uint32_t) serial;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    memcpy(p, &value, sizeof(value)); // a single unaligned store.
+}
 
-    /* Return 0 on success to match test expectations. */
-    return 0;
+// Load one of the little-endian 4-byte serial numbers of a B5 record.
+static inline int bdd_load_serial(const uint8_t *p) {
+    uint32_t serial;
+    memcpy(&serial, p, sizeof(serial)); // a single unaligned load.
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    serial = __builtin_bswap32(serial);
+#endif
+    return (int) serial;
 }
 
-BDD_NODE *bdd_deserialize(FILE *in) {
+// Store a value in LEB128, returning the byte after it.
+static inline uint8_t *bdd_store_varint(uint8_t *p, uint32_t value) {
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t) value;
+    return p;
+}
 
-    // Initialize hashmap.
-    for (int i = 0; i < BDD_HASH_SIZE; i++) {
+// Encode a reference from the node with the given serial to a child, for a B6 record.
+static inline uint32_t bdd_child_ref(int serial, int child) {
+    uint32_t byDistance = (uint32_t)(serial - child) << 1;
+    uint32_t bySerial = (uint32_t) child << 1 | 1;
+    return byDistance < bySerial ? byDistance : bySerial;
+}
 
-        *(bdd_hash_map + i) = NULL;
+// Load a LEB128 value from [p, end), returning the byte after it, or NULL if it's cut short or too big.
+static inline const uint8_t *bdd_load_varint(const uint8_t *p, const uint8_t *end, int64_t *value) {
+    int64_t v = 0;
+    for (int shift = 0; shift < 7 * BDD_VARINT_MAX && p < end; shift += 7) {
+        v |= (int64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *value = v;
+            return v <= INT32_MAX ? p : NULL;
+        }
     }
-    // Initialize bdd_index_map.
-    for (int i = 0; i < BDD_NODES_MAX; i++) {
-        *(bdd_index_map + i) = 0;
+    return NULL;
+}
+
+/*
+ * Index footers.
+ * A B5 or B6 file may end in an index that lets a reader pick out just the records a region
+ * of the image needs. It starts with BDD_INDEX_MARK where the next opcode would be, so
+ * deserializers that don't use it simply stop there, and holds, all little-endian:
+ *
+ *   4 bytes  the checkpoint interval K, then 4 bytes  the number of checkpoints,
+ *   8 bytes  for each checkpoint, the offset from the first record of records 1, K+1, 2K+1, ...
+ *   4 bytes  the quadrant depth D, then for each depth d from 0 to D, row by row,
+ *   4 bytes  the serial of the node covering each of the 2^d by 2^d quadrants at that depth
+ *   8 bytes  the offset of the mark from the first record, then the 4 bytes "BIDX".
+ *
+ * Quadrants divide the image at level E, the larger of bdd_min_level(w, h) and the root's
+ * level rounded up to even; the single quadrant at depth 0 is the root, which is also the
+ * last record.
+ */
+#define BDD_INDEX_MARK '~'
+#define BDD_INDEX_MAGIC "BIDX"
+#define BDD_INDEX_INTERVAL 256
+#define BDD_INDEX_DEPTH 4
+
+typedef struct {
+    int level;          // E.
+    int depth;          // D.
+    uint64_t *offsets;  // of every BDD_INDEX_INTERVAL-th record, collected as they're written.
+    int count;
+    int capacity;
+    uint64_t length;    // of the records, which is where the footer starts.
+    uint32_t *quadrants;
+} BDD_INDEX;
+
+// Follow a node down from a block at level from to the one at level to holding pixel (row, col).
+static int bdd_descend(int index, int from, int to, int row, int col) {
+    for (int level = from; level > to && index >= BDD_NUM_LEAVES; level--) {
+        BDD_NODE *node = NODE(index);
+        if ((*node).level < level) { continue; } // replicated across the skipped level.
+        int bit = level % 2 == 0 ? (row >> (level / 2 - 1)) & 1 : (col >> (level / 2)) & 1;
+        index = bit ? (*node).right : (*node).left;
     }
+    return index;
+}
 
-    int deserialize_serial = 1;
-    int readingNodes = 0; // initially false since we might have to go through the header and leaf nodes.
-    int character;
-    character = fgetc(in);
+/*
+ * Serialize in postorder, with an explicit stack in place of recursion. A frame holds a node
+ * and how many of its children have been dealt with; the stack never gets deeper than the
+ * number of levels. Each node is numbered and written the first time it is finished, and
+ * records pile up in the buffer, which goes out with one fwrite each time it fills.
+ * With delta set, records are written in the B6 format, and otherwise in the B5 one. Given
+ * an index, it also collects the checkpoints and quadrant serials for its footer.
+ */
+static int bdd_write_records(BDD_NODE *node, FILE *out, int delta, BDD_INDEX *index) {
+    if (node == NULL || out == NULL) { return -1;} // invalid.
+    int rootIndex = INDEX(node);
+    if (rootIndex < 0 || rootIndex >= bdd_node_extent()) { return -1; } // not in the node table.
+
+    uint8_t *buffer = malloc(BDD_SERIALIZE_BUFFER);
+    int *stackNodes = malloc(2 * (BDD_LEVELS_MAX + 2) * sizeof(int)); // stackDone is its second half.
+    if (buffer == NULL || stackNodes == NULL) {
+        free(buffer);
+        free(stackNodes);
+        return -1;
+    }
+    int *stackDone = stackNodes + BDD_LEVELS_MAX + 2;
+    uint8_t *fill = buffer;
+    uint64_t written = 0;
+    int depth = 0;
+    int result = 0;
 
-    while (character != EOF) {
+    bdd_serial_begin(); // every node starts out unnumbered.
+    int serialize_serial = 1;
+
+    // The root is whatever node we were handed, which need not be the most recently created one.
+    *stackNodes = rootIndex;
+    *stackDone = 0;
+    depth = 1;
+    while (depth > 0) {
+        int nodeIndex = *(stackNodes + depth - 1);
+        int *done = stackDone + depth - 1;
+        if (SERIAL_OF(nodeIndex) != 0) { depth--; continue; } // already written, through another parent.
+
+        if (nodeIndex >= BDD_NUM_LEAVES && *done < 2) {
+            BDD_NODE *current = NODE(nodeIndex);
+            *(stackNodes + depth) = *done == 0 ? (*current).left : (*current).right;
+            *(stackDone + depth) = 0;
+            (*done)++;
+            depth++;
+            continue;
+        }
 
-        if (character == '@') {
-            readingNodes = 1;
-            int colorVal = fgetc(in); // we have the color value now.
-            if (*(bdd_index_map + colorVal) == 0) {
-                *(bdd_index_map + colorVal) = deserialize_serial; // Update bdd_index_map with a serial number.
-                deserialize_serial++;
+        // Both children have serial numbers by now, so the node itself can be written.
+        if (fill - buffer > BDD_SERIALIZE_BUFFER - BDD_RECORD_MAX) {
+            if (fwrite(buffer, 1, fill - buffer, out) != (size_t)(fill - buffer)) { result = -1; break; }
+            written += fill - buffer;
+            fill = buffer;
+        }
+        if (index != NULL && (serialize_serial - 1) % BDD_INDEX_INTERVAL == 0) {
+            if ((*index).count == (*index).capacity) {
+                int capacity = (*index).capacity == 0 ? 1024 : 2 * (*index).capacity;
+                uint64_t *grown = realloc((*index).offsets, capacity * sizeof(uint64_t));
+                if (grown == NULL) { result = -1; break; }
+                (*index).offsets = grown;
+                (*index).capacity = capacity;
+            }
+            *((*index).offsets + (*index).count++) = written + (fill - buffer);
+        }
+        if (nodeIndex < BDD_NUM_LEAVES) {
+            *fill++ = '@';
+            *fill++ = (uint8_t) nodeIndex;
+        }
+        else {
+            BDD_NODE *current = NODE(nodeIndex);
+            uint8_t *opcode = fill++;
+            *opcode = '@' + (*current).level;
+            if (delta) {
+                int right = SERIAL_OF((*current).right);
+                fill = bdd_store_varint(fill, bdd_child_ref(serialize_serial, SERIAL_OF((*current).left)));
+                if (right == serialize_serial - 1) { *opcode |= BDD_RIGHT_PREVIOUS; }
+                else { fill = bdd_store_varint(fill, bdd_child_ref(serialize_serial, right)); }
+            }
+            else {
+                bdd_store_serial(fill, SERIAL_OF((*current).left));
+                bdd_store_serial(fill + 4, SERIAL_OF((*current).right));
+                fill += 8;
+            }
+        }
+        SET_SERIAL(nodeIndex, serialize_serial);
+        serialize_serial++;
+        depth--;
+    }
+    if (result == 0 && fwrite(buffer, 1, fill - buffer, out) != (size_t)(fill - buffer)) { result = -1; }
+    written += fill - buffer;
+
+    // The quadrant serials have to be looked up before the numbering is let go of.
+    if (result == 0 && index != NULL) {
+        int E = (*index).level;
+        uint32_t *quadrant = (*index).quadrants;
+        for (int d = 0; d <= (*index).depth; d++) {
+            int side = 1 << (E / 2 - d);
+            for (int qr = 0; qr < 1 << d; qr++) {
+                for (int qc = 0; qc < 1 << d; qc++) {
+                    *quadrant++ = SERIAL_OF(bdd_descend(rootIndex, E, E - 2 * d, qr * side, qc * side));
+                }
             }
         }
+    }
+    bdd_serial_end(serialize_serial);
+    free(stackNodes);
+    free(buffer);
+    if (index != NULL) { (*index).length = written; }
+    return result;
+}
 
-        if (character >= 'A' && character <= 'Z') {  /* or 65..90 */
-            readingNodes = 1;
-            int level = character - 64;
+int bdd_serialize_records(BDD_NODE *node, FILE *out, int delta) {
+    return bdd_write_records(node, out, delta, NULL);
+}
 
-            int left1 = fgetc(in); // LSB
-            int left2 = fgetc(in); // 2nd from right
-            int left3 = fgetc(in); // 3rd from right
-            int left4 = fgetc(in); // MSB
+int bdd_serialize(BDD_NODE *node, FILE *out) {
+    return bdd_write_records(node, out, 0, NULL);
+}
 
-            int right1 = fgetc(in); // LSB
-            int right2 = fgetc(in); // 2nd from right
-            int right3 = fgetc(in); // 3rd from right
-            int right4 = fgetc(in); // MSB
+// Write a 4-byte, then an 8-byte, little-endian footer field.
+static int bdd_put_u32(uint32_t value, FILE *out) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        if (fputc((value >> shift) & 0xFF, out) == EOF) { return -1; }
+    }
+    return 0;
+}
 
-            // stored as 1,2,3,4 but we want it as 4,3,2,1.
-            //debug("%c level, %i/%i/%i/%i left and %i/%i/%i/%i right.\n", level + 64, left1, left2, left3, left4, right1, right2, right3, right4);
-            int bigLeft = 0;
-            bigLeft += left1;
-            bigLeft += left2 << 8;
-            bigLeft += left3 << 16;
-            bigLeft += left4 << 24;
+static int bdd_put_u64(uint64_t value, FILE *out) {
+    if (bdd_put_u32((uint32_t) value, out) == -1) { return -1; }
+    return bdd_put_u32((uint32_t)(value >> 32), out);
+}
 
-            int bigRight = 0;
-            bigRight += right1;
-            bigRight += right2 << 8;
-            bigRight += right3 << 16;
-            bigRight += right4 << 24;
-            //debug("now we have %c level, %i left, %i right\n", level + 64, bigLeft, bigRight);
+/*
+ * Serialize a BDD for a w by h image as bdd_serialize_records() does, and follow the
+ * records with an index footer so that regions can be read without the rest of the file.
+ */
+int bdd_serialize_indexed(BDD_NODE *node, int w, int h, FILE *out, int delta) {
+    if (node == NULL || w < 0 || h < 0) { return -1; }
+    BDD_INDEX index = {0};
+    index.level = bdd_min_level(w, h);
+    if ((*node).level > index.level) { index.level = (*node).level + (*node).level % 2; }
+    index.depth = index.level / 2 < BDD_INDEX_DEPTH ? index.level / 2 : BDD_INDEX_DEPTH;
+    int quadrants = 0;
+    for (int d = 0; d <= index.depth; d++) { quadrants += 1 << (2 * d); }
+    index.quadrants = malloc(quadrants * sizeof(uint32_t));
+
+    int result = index.quadrants == NULL ? -1 : bdd_write_records(node, out, delta, &index);
+    if (result == 0) {
+        result |= fputc(BDD_INDEX_MARK, out) == EOF ? -1 : 0;
+        result |= bdd_put_u32(BDD_INDEX_INTERVAL, out);
+        result |= bdd_put_u32(index.count, out);
+        for (int i = 0; i < index.count; i++) { result |= bdd_put_u64(*(index.offsets + i), out); }
+        result |= bdd_put_u32(index.depth, out);
+        for (int i = 0; i < quadrants; i++) { result |= bdd_put_u32(*(index.quadrants + i), out); }
+        result |= bdd_put_u64(index.length, out);
+        result |= fwrite(BDD_INDEX_MAGIC, 1, 4, out) == 4 ? 0 : -1;
+    }
+    free(index.offsets);
+    free(index.quadrants);
+    return result == 0 ? 0 : -1;
+}
 
-            // Now we have the level, left serial, and right serial of a node.
-            // The left and right serials are guaranteed to exist already, so we just need to find their corresponding index and create a new node.
+/*
+ * Parse the record at [p, end) that gets the given serial number, in the B6 format if delta
+ * is set and the B5 one otherwise. Sets the opcode, and either the leaf value in *left or the
+ * serials of both children. Returns the byte after the record, or NULL if it's malformed.
+ */
+static const uint8_t *bdd_parse_record(const uint8_t *p, const uint8_t *end, int delta, int serial,
+                                       int *opcode, int *left, int *right) {
+    if (p == end) { return NULL; }
+    *opcode = *p++;
+    if (*opcode == '@') {
+        if (p == end) { return NULL; }
+        *left = *p++;
+        return p;
+    }
+    int rightPrevious = delta && (*opcode & BDD_RIGHT_PREVIOUS);
+    if (rightPrevious) { *opcode &= ~BDD_RIGHT_PREVIOUS; }
+    if (*opcode <= '@' || *opcode > '@' + BDD_LEVELS_MAX) { return NULL; } // not an opcode.
+    if (!delta) {
+        if (end - p < 8) { return NULL; }
+        *left = bdd_load_serial(p);
+        *right = bdd_load_serial(p + 4);
+        return p + 8;
+    }
 
-            // big left and right are serials.
+    int64_t leftRef, rightRef = 2; // the preceding record is 1 back.
+    if ((p = bdd_load_varint(p, end, &leftRef)) == NULL) { return NULL; }
+    if (!rightPrevious && (p = bdd_load_varint(p, end, &rightRef)) == NULL) { return NULL; }
+    *left = (int)(leftRef & 1 ? leftRef >> 1 : serial - (leftRef >> 1));
+    *right = (int)(rightRef & 1 ? rightRef >> 1 : serial - (rightRef >> 1));
+    return p;
+}
 
-            int leftIndex;
-            int rightIndex;
+/*
+ * Build the node for the record with the given serial number, and note its index in
+ * bdd_index_map, which deserializing uses the other way round, as a map from serial numbers
+ * to indices. Children must have come earlier in the stream and sit at lower levels.
+ * Returns the index, or -1 if the record is malformed or the table is full.
+ */
+static int bdd_deserialize_record(int opcode, int left, int right, int serial) {
+    if (serial >= BDD_NODES_LIMIT) { return -1; }
+    if (serial >= BDD_NODES_MAX && bdd_ext_commit(serial + 1) == -1) { return -1; }
+
+    int index = left; // a leaf is its own value.
+    if (opcode != '@') {
+        int level = opcode - '@';
+        if (left < 1 || left >= serial || right < 1 || right >= serial) { return -1; } // not built yet.
+
+        int leftIndex = *INDEX_MAP(left);
+        int rightIndex = *INDEX_MAP(right);
+        if ((*NODE(leftIndex)).level >= level || (*NODE(rightIndex)).level >= level) { return -1; }
+        if ((index = bdd_lookup(level, leftIndex, rightIndex)) == -1) { return -1; }
+    }
+    *INDEX_MAP(serial) = index;
+    return index;
+}
 
-            for (int i = 0; i < BDD_NODES_MAX; i++) {
-                if (*(bdd_index_map + i) == bigLeft) {
-                    leftIndex = i;
-                    break;
-                }
-            }
+// Finish deserializing: hand the serial-to-index entries back to serialization as unnumbered.
+static BDD_NODE *bdd_deserialize_end(int next, int root) {
+    for (int serial = 1; serial < next; serial++) {
+        *INDEX_MAP(serial) = 0;
+    }
+    if (root == -1) { return NULL; } // no records at all, or a bad one.
+    return NODE(root);
+}
 
-            for (int i = 0; i < BDD_NODES_MAX; i++) {
-                if (*(bdd_index_map + i) == bigRight) {
-                    rightIndex = i;
-                    break;
-                }
-            }
+// Read the bytes of one record, after its opcode, from a stream. Returns the record's length, or -1.
+static int bdd_fread_record(FILE *in, int opcode, int delta, uint8_t *record) {
+    int length = 1;
+    int c;
+    *record = opcode;
+    if (opcode == '@') {
+        if ((c = fgetc(in)) == EOF) { return -1; }
+        *(record + length++) = c;
+        return length;
+    }
+    int rightPrevious = delta && (opcode & BDD_RIGHT_PREVIOUS);
+    if (rightPrevious) { opcode &= ~BDD_RIGHT_PREVIOUS; }
+    if (opcode <= '@' || opcode > '@' + BDD_LEVELS_MAX) { return -1; }
+    if (!delta) {
+        return fread(record + 1, 1, 8, in) == 8 ? 9 : -1;
+    }
+    // One or two LEB128 values, each ending in a byte without the top bit.
+    for (int ends = rightPrevious; ends < 2; ) {
+        if (length == BDD_RECORD_MAX || (c = fgetc(in)) == EOF) { return -1; }
+        *(record + length++) = c;
+        if ((c & 0x80) == 0) { ends++; }
+    }
+    return length;
+}
 
-            //debug("NEW: %i level, %i left, %i right\n", level, bigLeft, bigRight);
-            int nodeIndex = bdd_lookup(level, leftIndex, rightIndex);
-            if (nodeIndex == -1) {return NULL;}
+/*
+ * Deserialization is a single pass: each record's children are found by direct lookup of
+ * their serial numbers in bdd_index_map, and every opcode, child reference and level is
+ * checked as it is read. Any malformed record fails the whole BDD.
+ */
+BDD_NODE *bdd_deserialize_records(FILE *in, int delta) {
+    if (in == NULL) { return NULL; }
+    if (bdd_hash_reset() == -1) { return NULL; }
+
+    uint8_t *record = malloc(BDD_RECORD_MAX); // the bytes of one record, opcode first.
+    if (record == NULL) { return NULL; }
+
+    int serial = 1;
+    int root = -1; // index of the node built from the most recent record.
+    int opcode, left, right, length;
+    while ((opcode = fgetc(in)) != EOF && opcode != BDD_INDEX_MARK) { // the rest is an index.
+        if ((length = bdd_fread_record(in, opcode, delta, record)) == -1
+            || bdd_parse_record(record, record + length, delta, serial, &opcode, &left, &right) == NULL
+            || (root = bdd_deserialize_record(opcode, left, right, serial)) == -1) {
+            root = -1;
+            break;
+        }
+        serial++;
+    }
+    free(record);
+    return bdd_deserialize_end(serial, root);
+}
 
-            // Node successfully created. Store the serial in the index map.
-            // the index of the newly created node is returned and stored.
-            *(bdd_index_map + nodeIndex) = deserialize_serial;
-            deserialize_serial++;
+BDD_NODE *bdd_deserialize(FILE *in) {
+    return bdd_deserialize_records(in, 0);
+}
 
+/*
+ * Deserialize a BDD from the size bytes at data, typically the mapped input file, in the
+ * B6 format if delta is set and the B5 one otherwise. It builds the same nodes as
+ * bdd_deserialize_records(), but reads each record straight out of the buffer.
+ */
+BDD_NODE *bdd_deserialize_buffer(const uint8_t *data, size_t size, int delta) {
+    if (data == NULL) { return NULL; }
+    if (bdd_hash_reset() == -1) { return NULL; }
+
+    int serial = 1;
+    int root = -1; // index of the node built from the most recent record.
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    int opcode, left, right;
+    while (p < end && *p != BDD_INDEX_MARK) {
+        if ((p = bdd_parse_record(p, end, delta, serial, &opcode, &left, &right)) == NULL
+            || (root = bdd_deserialize_record(opcode, left, right, serial)) == -1) {
+            root = -1;
+            break;
         }
-        character = fgetc(in);
-        if (readingNodes == 0) {continue;}
+        serial++;
     }
-    //debug("%i serials in deserialize\n", deserialize_serial);
-    //debug("%i nodes created.\n", (freespot()- 256));
-    //debug("%i level, %i left, %i right root\n", (*root).level, (*root).left, (*root).right);
+    return bdd_deserialize_end(serial, root);
+}
 
-    return (bdd_nodes + freeSpot()-1);
+/*
+ * Region reads.
+ * With an index footer, a window of the image can be rebuilt from the records it overlaps
+ * alone. The records between two checkpoints form a block, which is parsed in one pass the
+ * first time any of its records is wanted and kept decoded from then on, so no record is
+ * parsed twice. Each record is built at most once, its index kept in memo. Parts of the
+ * image outside the window become black leaves, so what comes back decodes exactly like the
+ * full BDD inside the window and is cheap everywhere else. Working on the mapped file, only
+ * the pages holding those records are ever read in. A window over most of the image would
+ * touch most blocks anyway, and is left to a plain read of them all.
+ */
+typedef struct {
+    const uint8_t *records;
+    const uint8_t *end;      // of the records, where the footer starts.
+    int delta;
+    int interval;
+    int count;               // of records; the root is the last.
+    const uint8_t *offsets;  // the footer's checkpoints,
+    const uint8_t *quadrants; // and its quadrant serials.
+    int *memo;               // index + 1 by serial, or 0 if not built yet.
+    int **blocks;            // by checkpoint, its records decoded, or NULL if not parsed yet.
+    int x, y, w, h;          // the window.
+} BDD_REGION;
+
+static uint64_t bdd_load_u64(const uint8_t *p) {
+    return (uint32_t) bdd_load_serial(p) | (uint64_t)(uint32_t) bdd_load_serial(p + 4) << 32;
 }
 
-unsigned char bdd_apply(BDD_NODE *node, int r, int c) {
+/*
+ * The record with the given serial as three ints: its opcode, then its children's serials,
+ * or for a leaf its value. Parses the record's whole block if that hasn't been done yet.
+ * Returns NULL if the record can't be found or its block is malformed.
+ */
+static const int *bdd_region_record(BDD_REGION *region, int serial) {
+    if (serial < 1 || serial > (*region).count) { return NULL; }
+    int checkpoint = (serial - 1) / (*region).interval;
+    int first = checkpoint * (*region).interval + 1;
+    int **block = (*region).blocks + checkpoint;
+    if (*block == NULL) {
+        int last = (*region).count - first < (*region).interval ? (*region).count : first + (*region).interval - 1;
+        uint64_t offset = bdd_load_u64((*region).offsets + 8 * (size_t) checkpoint);
+        if (offset >= (uint64_t)((*region).end - (*region).records)) { return NULL; }
+        int *records = malloc(3 * (size_t)(last - first + 1) * sizeof(int));
+        if (records == NULL) { return NULL; }
+        const uint8_t *p = (*region).records + offset;
+        for (int s = first; s <= last; s++) {
+            int *record = records + 3 * (size_t)(s - first);
+            if ((p = bdd_parse_record(p, (*region).end, (*region).delta, s, record, record + 1, record + 2)) == NULL) {
+                free(records);
+                return NULL;
+            }
+        }
+        *block = records;
+    }
+    return *block + 3 * (size_t)(serial - first);
+}
 
-    // This is the root node so we can get d from this.
-    int d = (*node).level / 2;
+static int bdd_record_level(BDD_REGION *region, int serial) {
+    const int *record = bdd_region_record(region, serial);
+    return record == NULL ? -1 : *record - '@';
+}
 
-    int bitsToExpect = 2 * d;
+// Build the whole subgraph under a record. Levels fall on the way down, so this stays shallow.
+static int bdd_region_resolve(BDD_REGION *region, int serial) {
+    if (serial < 1 || serial > (*region).count) { return -1; }
+    if (*((*region).memo + serial) != 0) { return *((*region).memo + serial) - 1; }
+    const int *record = bdd_region_record(region, serial);
+    if (record == NULL) { return -1; }
+    int opcode = *record, left = *(record + 1), right = *(record + 2);
+    int index = left; // a leaf is its own value.
+    if (opcode != '@') {
+        int level = opcode - '@';
+        if (left >= serial || right >= serial) { return -1; }
+        int leftLevel = bdd_record_level(region, left);
+        int rightLevel = bdd_record_level(region, right);
+        if (leftLevel < 0 || leftLevel >= level || rightLevel < 0 || rightLevel >= level) { return -1; }
+        int leftIndex = bdd_region_resolve(region, left);
+        int rightIndex = bdd_region_resolve(region, right);
+        if (leftIndex == -1 || rightIndex == -1) { return -1; }
+        if ((index = bdd_lookup(level, leftIndex, rightIndex)) == -1) { return -1; }
+    }
+    *((*region).memo + serial) = index + 1;
+    return index;
+}
 
-    int direction;
-    int rMask = 0;
-    int rPtr = 0; // bit ptr to determine the shift
+/*
+ * Build the block at the given level with its top left pixel at (row, col), as the record
+ * with the given serial covers it, clipped to the window. Returns the index, or -1.
+ */
+static int bdd_region_build(BDD_REGION *region, int serial, int level, int row, int col) {
+    int height = 1 << (level / 2);
+    int width = 1 << ((level + 1) / 2);
+    if (row >= (*region).y + (*region).h || row + height <= (*region).y
+        || col >= (*region).x + (*region).w || col + width <= (*region).x) {
+        return 0; // outside the window.
+    }
+    if (row >= (*region).y && row + height <= (*region).y + (*region).h
+        && col >= (*region).x && col + width <= (*region).x + (*region).w) {
+        return bdd_region_resolve(region, serial); // all inside.
+    }
 
-    int cMask = 0;
-    int cPtr = 0;
-    BDD_NODE *current = node;
+    const int *record = bdd_region_record(region, serial);
+    if (record == NULL) { return -1; }
+    int opcode = *record, left = *(record + 1), right = *(record + 2);
+    if (opcode == '@') { return left; } // the same value everywhere.
+    int nodeLevel = opcode - '@';
+    if (nodeLevel > level || left >= serial || right >= serial) { return -1; }
+    if (nodeLevel < level) { left = right = serial; } // replicated across this level.
+
+    // Even levels split top from bottom, odd ones left from right.
+    int leftIndex = bdd_region_build(region, left, level - 1, row, col);
+    int rightIndex = level % 2 == 0 ? bdd_region_build(region, right, level - 1, row + height / 2, col)
+                                    : bdd_region_build(region, right, level - 1, row, col + width / 2);
+    if (leftIndex == -1 || rightIndex == -1) { return -1; }
+    return bdd_lookup(level, leftIndex, rightIndex);
+}
 
-    // row -> col -> row -> col | if i is even, then take the next row bit. else take the next col bit.
-    for (int i = 0; i < bitsToExpect; i++) {
+// Build quadrant (qr, qc) at depth d of D, starting from the footer's serials for depth D.
+static int bdd_region_quadrant(BDD_REGION *region, int E, int d, int D, int qr, int qc) {
+    int level = E - 2 * d;
+    if (d == D) {
+        int first = 0;
+        for (int i = 0; i < D; i++) { first += 1 << (2 * i); }
+        int serial = bdd_load_serial((*region).quadrants + 4 * (first + (qr << D) + qc));
+        return bdd_region_build(region, serial, level, qr << (E / 2 - d), qc << (E / 2 - d));
+    }
+    int side = 1 << (E / 2 - d);
+    if (qr * side >= (*region).y + (*region).h || (qr + 1) * side <= (*region).y
+        || qc * side >= (*region).x + (*region).w || (qc + 1) * side <= (*region).x) {
+        return 0; // outside the window.
+    }
+    int topLeft = bdd_region_quadrant(region, E, d + 1, D, 2 * qr, 2 * qc);
+    int topRight = bdd_region_quadrant(region, E, d + 1, D, 2 * qr, 2 * qc + 1);
+    int bottomLeft = bdd_region_quadrant(region, E, d + 1, D, 2 * qr + 1, 2 * qc);
+    int bottomRight = bdd_region_quadrant(region, E, d + 1, D, 2 * qr + 1, 2 * qc + 1);
+    if (topLeft == -1 || topRight == -1 || bottomLeft == -1 || bottomRight == -1) { return -1; }
+    int top = bdd_lookup(level - 1, topLeft, topRight);
+    int bottom = bdd_lookup(level - 1, bottomLeft, bottomRight);
+    if (top == -1 || bottom == -1) { return -1; }
+    return bdd_lookup(level, top, bottom);
+}
 
-        // even, take row bit.
-        if (i % 2 == 0) {
-            rMask = 1 << (d - 1 - rPtr);
-            direction = (r & rMask) >> (d - 1 - rPtr);
-            rPtr++;
-        }
-        // Odd, take col bit.
-        else {
-            cMask = 1 << (d - 1 - cPtr);
-            direction = (c & cMask) >> (d - 1 - cPtr);
-            cPtr++;
+/*
+ * Deserialize just the part of a BDD for a w by h image that the window of ww by wh pixels at
+ * (x, y) needs, from records followed by an index footer in the size bytes at data. Returns
+ * NULL if there is no footer, if it or the records it leads to are malformed, or if the window
+ * covers half the image or more; the caller reads the whole BDD then.
+ */
+BDD_NODE *bdd_deserialize_window(const uint8_t *data, size_t size, int delta, int w, int h,
+                                 int x, int y, int ww, int wh) {
+    if (data == NULL || size < 13 || memcmp(data + size - 4, BDD_INDEX_MAGIC, 4) != 0) { return NULL; }
+    int64_t across = (x + (int64_t) ww < w ? x + (int64_t) ww : w) - x; // of the window, on the image.
+    int64_t down = (y + (int64_t) wh < h ? y + (int64_t) wh : h) - y;
+    if (across > 0 && down > 0 && 2 * across * down >= (int64_t) w * h) { return NULL; }
+    uint64_t footer = bdd_load_u64(data + size - 12);
+    if (footer >= size - 12 || *(data + footer) != BDD_INDEX_MARK) { return NULL; }
+
+    // Check the footer's fields fit exactly between the mark and the trailer.
+    BDD_REGION region = {data, data + footer, delta, 0, 0, NULL, NULL, NULL, NULL, x, y, ww, wh};
+    const uint8_t *p = data + footer + 1;
+    const uint8_t *trailer = data + size - 12;
+    if (trailer - p < 8) { return NULL; }
+    region.interval = bdd_load_serial(p);
+    int checkpoints = bdd_load_serial(p + 4);
+    p += 8;
+    if (region.interval < 1 || checkpoints < 1 || (trailer - p) / 8 < checkpoints) { return NULL; }
+    region.offsets = p;
+    p += 8 * (size_t) checkpoints;
+    if (trailer - p < 4) { return NULL; }
+    int D = bdd_load_serial(p);
+    p += 4;
+    if (D < 0 || D > BDD_INDEX_DEPTH) { return NULL; }
+    int quadrants = 0;
+    for (int d = 0; d <= D; d++) { quadrants += 1 << (2 * d); }
+    if (trailer - p != 4 * quadrants) { return NULL; }
+    region.quadrants = p;
+
+    // The root is the last record, and the only quadrant at depth 0.
+    region.count = bdd_load_serial(region.quadrants);
+    if (region.count < 1 || (region.count - 1) / region.interval + 1 != checkpoints) { return NULL; }
+    if ((region.blocks = calloc(checkpoints, sizeof(int *))) == NULL) { return NULL; }
+    int root = -1;
+    int rootLevel = bdd_record_level(&region, region.count);
+    int E = bdd_min_level(w, h);
+    if (rootLevel > E) { E = rootLevel + rootLevel % 2; }
+    if (rootLevel >= 0 && D <= E / 2 && bdd_hash_reset() == 0
+        && (region.memo = calloc((size_t) region.count + 1, sizeof(int))) != NULL) {
+        root = bdd_region_quadrant(&region, E, 0, D, 0, 0);
+    }
+    free(region.memo);
+    for (int i = 0; i < checkpoints; i++) { free(*(region.blocks + i)); }
+    free(region.blocks);
+    if (root == -1) { return NULL; }
+    return NODE(root);
+}
 
-        }
-        //debug("cptr: %i, rptr: %i\n", cPtr, rPtr);
-        if (direction == 0) { // left
-            if ((*LEFT(current, (*current).level - 1)).level == 0) { // If left is color node, return that.
-                //debug("LEFT: %i left, %i right\n", (*current).left, (*current).right);
-                return (*current).left;
-            }
-            // We have "dead bits" that weren't included in the bdd. skip over those. (ie going from lvl 5 to 2 with nothing in between.)
-            if ((*LEFT(current, (*current).level - 1)).level != (*current).level - 1) {
-                //debug("(%i, %i) SKIPPING LEFT FROM %i TO %i\n", r, c, (*current).level, (*current).level -(*LEFT(current, (*current).level - 1)).level-1);
-
-                // we need to determine how many column and row bits we skip when jumping down.
-                // Just loop from 0 to the bit difference, which ptr we increment first depends on whether we're currently on a row or col bit.
-                // If we're on a col bit, then we increment row first and vice versa.
-                if (i % 2 == 0) { // on a row bit, increment col first.
-                    for (int j = 0; j < (*current).level -(*LEFT(current, (*current).level - 1)).level - 1; j++) {
-                        if (j % 2 == 0) {cPtr++;}
-                        else {rPtr++;}
-                    }
-                }
-                else {
-                    for (int j = 0; j < (*current).level -(*LEFT(current, (*current).level - 1)).level - 1; j++) {
-                        if (j % 2 == 0) {rPtr++;}
-                        else {cPtr++;}
-                    }
-                }
-                i += ((*current).level -(*LEFT(current, (*current).level - 1)).level - 1); // ie: 5 to 2 means we skip 3 levels (current.level - next.level)
-            }
-            current = LEFT(current, (*current).level - 1); // Otherwise go left.
-        }
+/*
+ * Point queries.
+ * Interleaving the bits of r and c into a Morton code, column bit k at bit 2k and row bit k at
+ * bit 2k+1, lines the coordinates up with the levels: a node at level l tests bit l-1 of the
+ * code. A query is then one shift and mask per node on its path, and levels the BDD skips
+ * cost nothing. Sorting many queries by code puts neighbours in the image next to each other,
+ * and successive codes agree on every bit above the highest one in which they differ, so
+ * each query can resume from the deepest node its predecessor's path shares with it.
+ */
+static uint64_t bdd_spread_bits(uint32_t x) {
+    uint64_t v = x;
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+}
 
+#define MORTON(r, c) ((bdd_spread_bits((uint32_t)(r)) << 1) | bdd_spread_bits((uint32_t)(c)))
+#define MORTON_BIT(code, np) (((code) >> ((np)->level - 1)) & 1)
 
-        else { // right
-            if ((*RIGHT(current, (*current).level - 1)).level == 0) {
-                //debug("RIGHT: %i left, %i right\n", (*current).left, (*current).right);
-                return (*current).right;
-            }
+unsigned char bdd_apply(BDD_NODE *node, int r, int c) {
+    uint64_t code = MORTON(r, c);
+    BDD_NODE *current = node;
+    while ((*current).level > 0) {
+        current = MORTON_BIT(code, current) ? NODE((*current).right) : NODE((*current).left);
+    }
+    return (unsigned char)INDEX(current);
+}
 
-            // We have "dead bits" that weren't included in the bdd. skip over those. (ie going from lvl 5 to 2 with nothing in between.)
-            if ((*RIGHT(current, (*current).level - 1)).level != (*current).level - 1) {
-                //debug("(%i, %i) SKIPPING RIGHT FROM %i TO %i\n", r, c, (*current).level, (*current).level -(*RIGHT(current, (*current).level - 1)).level-1);
-
-                // we need to determine how many column and row bits we skip when jumping down.
-                // Just loop from 0 to the bit difference, which ptr we increment first depends on whether we're currently on a row or col bit.
-                // If we're on a col bit, then we increment row first and vice versa.
-                if (i % 2 == 0) { // on a row bit, increment col first.
-                    for (int j = 0; j < (*current).level -(*RIGHT(current, (*current).level - 1)).level - 1; j++) {
-                        if (j % 2 == 0) {cPtr++;}
-                        else {rPtr++;}
-                    }
-                }
-                else {
-                    for (int j = 0; j < (*current).level -(*RIGHT(current, (*current).level - 1)).level - 1; j++) {
-                        if (j % 2 == 0) {rPtr++;}
-                        else {cPtr++;}
-                    }
-                }
-                i += ((*current).level -(*RIGHT(current, (*current).level - 1)).level - 1); // ie: 5 to 2 means we skip 3 levels(current.level - next.level - 1)
+typedef struct bdd_sample {
+    uint64_t code;
+    int index; // Position of the query in the caller's arrays.
+} BDD_SAMPLE;
+
+static int bdd_sample_compare(const void *a, const void *b) {
+    uint64_t x = (*(const BDD_SAMPLE *)a).code;
+    uint64_t y = (*(const BDD_SAMPLE *)b).code;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Evaluate a BDD at n points at once: coords holds n (row, column) pairs, and the value at
+ * pair i is stored in out[i]. Returns 0 on success, -1 on bad arguments or lack of memory.
+ */
+int bdd_apply_batch(BDD_NODE *node, const int *coords, int n, unsigned char *out) {
+    if (node == NULL || coords == NULL || out == NULL || n < 0) { return -1; }
+    if (n == 0) { return 0; }
+
+    BDD_SAMPLE *samples = malloc((size_t)n * sizeof(BDD_SAMPLE));
+    // The path taken by the previous query, root first; levels strictly decrease along it.
+    BDD_NODE **path = malloc((BDD_LEVELS_MAX + 1) * sizeof(BDD_NODE *));
+    if (samples == NULL || path == NULL) {
+        free(samples);
+        free(path);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        (*(samples + i)).code = MORTON(*(coords + 2 * i), *(coords + 2 * i + 1));
+        (*(samples + i)).index = i;
+    }
+    qsort(samples, n, sizeof(BDD_SAMPLE), bdd_sample_compare);
+
+    int depth = 1;
+    *path = node;
+    uint64_t previous = 0;
+    unsigned char value = 0;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t code = (*(samples + i)).code;
+        if (i > 0) {
+            uint64_t differ = code ^ previous;
+            if (differ == 0) { // same point again.
+                *(out + (*(samples + i)).index) = value;
+                continue;
             }
+            // Keep the steps decided by bits above the highest differing one.
+            int bit = 63 - __builtin_clzll(differ);
+            while (depth > 1 && (**(path + depth - 2)).level - 1 <= bit) { depth--; }
+        }
 
-            current = RIGHT(current, (*current).level - 1); // Otherwise go left.
+        BDD_NODE *current = *(path + depth - 1);
+        while ((*current).level > 0) {
+            current = MORTON_BIT(code, current) ? NODE((*current).right) : NODE((*current).left);
+            *(path + depth++) = current;
         }
-        //debug("cptr: %i, rptr: %i\n", cPtr, rPtr);
+        value = (unsigned char)INDEX(current);
+        *(out + (*(samples + i)).index) = value;
+        previous = code;
     }
-    return -1; // Error has occurred.
+
+    free(path);
+    free(samples);
+    return 0;
 }
 
-int postorder_apply(BDD_NODE *current, int nodeNum, unsigned char (*func)(unsigned char), int *index) {
+int postorder_apply(BDD_NODE *current, int nodeNum, unsigned char (*func)(unsigned char)) {
     // base case: we hit a value to apply the function to.
     if ((*current).level == 0) {
         //debug("%i color, %i transformed", (int)nodeNum, (int)((*func)(nodeNum)));
@@ -572,104 +1987,97 @@ int postorder_apply(BDD_NODE *current, int nodeNum, unsigned char (*func)(unsign
     }
 
     else {
-        int left = postorder_apply(LEFT(current, (*current).level - 1), (*current).left, func, index);
-        int right = postorder_apply(RIGHT(current, (*current).level - 1), (*current).right, func, index);
+        uint64_t key = CACHE_KEY(OP_MAP, bdd_map_serial, nodeNum);
+        int node = bdd_cache_find(key);
+        if (node != -1) { return node; } // subgraph already mapped along another path.
+
+        int left = postorder_apply(LEFT(current, (*current).level - 1), (*current).left, func);
+        int right = postorder_apply(RIGHT(current, (*current).level - 1), (*current).right, func);
 
 
         //debug("%i level, %i left, %i right\n", (*current).level, left, right);
-        int node = bdd_lookup((*current).level, left, right);
-        //debug("index: %i\n", freeSpot());
-        //debug("node created at %i with left %i and right %i with level %i\n", node, (*(bdd_nodes + node)).left, (*(bdd_nodes + node)).right, (*(bdd_nodes + node)).level);
-        if (node == (*index)) { (*index) = (*index) + 1;} // new node created.
-        return node;
+        node = bdd_lookup((*current).level, left, right);
+        return bdd_cache_store(key, node);
     }
 }
 
 BDD_NODE *bdd_map(BDD_NODE *node, unsigned char (*func)(unsigned char)) {
-    // the new bdd starts at index freeSpot(). We can start there.
-    //debug("%i is where old bdd ends.\n", freeSpot() - 1);
-    int newbdd_unused_node_index = freeSpot();
-
-    int newRoot = postorder_apply(node, freeSpot() - 1, func, &newbdd_unused_node_index); // pass index - 1 since that's the root of the previous bdd.
-    //debug("%i is the root of the new bdd. newroot is %i.\n", newRoot, freeSpot()-1);
-    return (bdd_nodes + newRoot);
-}
-
-
-// 0 = row, 1 = col
-int recursive_bdd_rotator(int level, int sizeR, int sizeC, int topLeftR, int topLeftC, BDD_NODE *root, int *index) {
-
-    if (level == 0) {
-        //debug("(%i, %i)\n", topLeftR, topLeftC);
-        return bdd_apply(root, topLeftR, topLeftC);
+    if (node == NULL) { return NULL; }
+
+    // func may depend on global state (the threshold reads global_options), so results are
+    // only reused within one call: each call tags its cache entries with a fresh serial.
+    bdd_map_serial = (bdd_map_serial + 1) & 0xFFFFFF;
+    if (bdd_map_serial == 0) {
+        bdd_cache_flush(); // serials wrapped; old entries could be mistaken for ours.
+        bdd_map_serial = 1;
     }
+    bdd_cache_reserve(bdd_node_high_water());
 
-    else {
-        int topLeft, topRight;
-        int botLeft, botRight;
-        // A B
-        // C D
-
-        topLeft = recursive_bdd_rotator(level - 2, sizeR / 2, sizeC / 2, topLeftR, topLeftC, root, index);
-
-        topRight = recursive_bdd_rotator(level - 2, sizeR / 2, sizeC / 2, topLeftR, topLeftC + (sizeC / 2), root, index);
-
-        botLeft = recursive_bdd_rotator(level - 2, sizeR / 2, sizeC / 2, topLeftR + (sizeR / 2), topLeftC, root, index);
-
-        botRight = recursive_bdd_rotator(level - 2, sizeR / 2, sizeC / 2, topLeftR + (sizeR / 2), topLeftC + (sizeC / 2), root, index);
-
-        //if (sizeR == 2) {
-            //debug("%i/%i\n%i/%i", topLeft, topRight, botLeft, botRight);
-        //}
-        int topSliver = bdd_lookup(level - 1, topRight, botRight);
-        if (topSliver == (*index)) { (*index) = (*index) + 1;}
-
-        int botSliver = bdd_lookup(level - 1, topLeft, botLeft);
-        if (botSliver == (*index)) { (*index) = (*index) + 1;}
-
-        int new = bdd_lookup(level, topSliver, botSliver);
-        if (new == (*index)) {
-            (*index) = (*index) + 1;
-        }
-        //debug("node created at %i with left %i and right %i with level %i\n", new, (*(bdd_nodes + new)).left, (*(bdd_nodes + new)).right, (*(bdd_nodes + new)).level);
-        //if (sizeR == 2) {
-            //debug("becomes: %i/%i\n%i/%i", (bdd_nodes + topSliver)->left, (bdd_nodes + topSliver)->right, (bdd_nodes + botSliver)->left, (bdd_nodes + botSliver)->right);
-        //}
-        return new;
+    int newRoot = postorder_apply(node, INDEX(node), func);
+    if (newRoot < 0) { return NULL; } // node table is full.
+    return NODE(newRoot);
+}
 
-    }
 
+/*
+ * Rotate the subgraph at nodeNum counterclockwise by working on node quadrants rather than
+ * pixels. A node is interpreted at its own level rounded up to even, so that it covers whole
+ * quadrants; the levels skipped above it only tile it, and rotating a tiling just tiles the
+ * rotated node, so the result stands for the same thing at any higher level.
+ */
+int recursive_bdd_rotator(int nodeNum) {
+    BDD_NODE *current = NODE(nodeNum);
+    if (nodeNum < BDD_NUM_LEAVES || (*current).level == 0) { return nodeNum; } // a single pixel.
+
+    uint64_t key = CACHE_KEY(OP_ROTATE, 0, nodeNum);
+    int new = bdd_cache_find(key);
+    if (new != -1) { return new; }
+
+    int level = (*current).level + ((*current).level % 2);
+
+    // A B
+    // C D
+    BDD_NODE *top = LEFT(current, level);
+    BDD_NODE *bottom = RIGHT(current, level);
+    int topLeft = recursive_bdd_rotator(INDEX(LEFT(top, level - 1)));
+    int topRight = recursive_bdd_rotator(INDEX(RIGHT(top, level - 1)));
+    int botLeft = recursive_bdd_rotator(INDEX(LEFT(bottom, level - 1)));
+    int botRight = recursive_bdd_rotator(INDEX(RIGHT(bottom, level - 1)));
+
+    // B' D'
+    // A' C'
+    int topSliver = bdd_lookup(level - 1, topRight, botRight);
+    int botSliver = bdd_lookup(level - 1, topLeft, botLeft);
+    new = bdd_lookup(level, topSliver, botSliver);
+    return bdd_cache_store(key, new);
 }
 
 BDD_NODE *bdd_rotate(BDD_NODE *node, int level) {
-    // We should be guaranteed to only work with a square here.
-    // The dimensions are equal to 2^d, where d = levels in the bdd / 2.
-    int dimensions = power(2, (*node).level / 2);
-    //debug("%ix%i dimensions\n", dimensions, dimensions);
-    //debug("%i is where old bdd ends.\n", freeSpot());
+    if (node == NULL || level < (*node).level || level > BDD_LEVELS_MAX) { return NULL; }
+    bdd_cache_reserve(bdd_node_high_water());
 
-    int newbdd_unused_node_index = freeSpot();
-    int newRoot = recursive_bdd_rotator(node->level, dimensions, dimensions, 0, 0, node, &newbdd_unused_node_index);
-    //debug("%i level, %i left, %i right\n", (bdd_nodes + newRoot)->level-1, (bdd_nodes + newRoot)->left, (bdd_nodes + newRoot)->right);
-    return bdd_nodes + newRoot;
+    int newRoot = recursive_bdd_rotator(INDEX(node));
+    if (newRoot < 0) { return NULL; } // node table is full.
+    return NODE(newRoot);
 }
 
 // newLevel keeps track of the level of the new BDD.
-int postorder_zoom_in(BDD_NODE *current, int nodeNum, int levelIncrease, int *index) {
+int postorder_zoom_in(BDD_NODE *current, int nodeNum, int levelIncrease) {
     if ((*current).level == 0) {
         return nodeNum;
     }
 
     else {
-        int left = postorder_zoom_in(LEFT(current, (*current).level - 1), (*current).left, levelIncrease, index);
-        int right = postorder_zoom_in(RIGHT(current, (*current).level - 1), (*current).right, levelIncrease, index);
+        uint64_t key = CACHE_KEY(OP_ZOOM_IN, levelIncrease, nodeNum);
+        int node = bdd_cache_find(key);
+        if (node != -1) { return node; }
 
-        int node = bdd_lookup((*current).level + levelIncrease, left, right);
-        if (node == (*index)) {
-            (*index) = (*index) + 1;
-        }
+        int left = postorder_zoom_in(LEFT(current, (*current).level - 1), (*current).left, levelIncrease);
+        int right = postorder_zoom_in(RIGHT(current, (*current).level - 1), (*current).right, levelIncrease);
+
+        node = bdd_lookup((*current).level + levelIncrease, left, right);
         //debug("NEW NODE: %i level, (%c letter), %i left, %i right\n", (*current).level + levelIncrease, (*current).level + levelIncrease + 64, left, right);
-        return node;
+        return bdd_cache_store(key, node);
     }
 }
 
@@ -680,16 +2088,20 @@ int checkReplacement(BDD_NODE *node, int nodeNum) {
     }
 
     else {
+        uint64_t key = CACHE_KEY(OP_NONZERO, 0, nodeNum);
+        int cached = bdd_cache_find(key);
+        if (cached != -1) { return cached; }
+
         int left = checkReplacement(LEFT(node, node->level - 1), node->left);
-        if (left == 255) { return 255;}
+        if (left == 255) { return bdd_cache_store(key, 255);}
 
         int right = checkReplacement(RIGHT(node, node->level - 1), node->right);
-        if (right == 255) { return 255;}
+        if (right == 255) { return bdd_cache_store(key, 255);}
 
-        return 0;
+        return bdd_cache_store(key, 0);
     }
 }
-int postorder_zoom_out(BDD_NODE *current, int nodeNum, int levelDecrease, int* index) {
+int postorder_zoom_out(BDD_NODE *current, int nodeNum, int levelDecrease) {
 
     if (current->level <= levelDecrease) {
         //debug("node hit at level %i with left %i and right %i\n", current->level, current-> left, current-> right);
@@ -699,13 +2111,16 @@ int postorder_zoom_out(BDD_NODE *current, int nodeNum, int levelDecrease, int* i
     else if (current-> level == 0) { return nodeNum;}
 
     else {
-        int left = postorder_zoom_out(LEFT(current, current->level-1), current->left, levelDecrease, index);
-        int right = postorder_zoom_out(RIGHT(current, current->level-1), current->right, levelDecrease, index);
+        uint64_t key = CACHE_KEY(OP_ZOOM_OUT, levelDecrease, nodeNum);
+        int node = bdd_cache_find(key);
+        if (node != -1) { return node; }
 
-        int node = bdd_lookup(current->level - levelDecrease, left, right);
-        if (node == (*index)) { (*index) = (*index) + 1;}
+        int left = postorder_zoom_out(LEFT(current, current->level-1), current->left, levelDecrease);
+        int right = postorder_zoom_out(RIGHT(current, current->level-1), current->right, levelDecrease);
+
+        node = bdd_lookup(current->level - levelDecrease, left, right);
         //debug("NEW NODE: %i level, (%c letter), %i left, %i right %i index\n", (*current).level - levelDecrease, (*current).level - levelDecrease + 64, left, right, node);
-        return node;
+        return bdd_cache_store(key, node);
     }
 }
 
@@ -714,23 +2129,144 @@ BDD_NODE *bdd_zoom(BDD_NODE *node, int level, int factor) {
     if (level < 0 || level > BDD_LEVELS_MAX) { return NULL;}
     //debug("zoom factor of %i\n", factor);
     if (factor == 0) { return node;} // Identity zoom by a factor of 1 (2^0 = 1)
+    bdd_cache_reserve(bdd_node_high_water());
 
-    else if (factor > 0) {
-        // the new bdd starts at index freeSpot(). We can start there.
-        //debug("%i is where old bdd ends.\n", freeSpot()-1);
-        int newbdd_unused_node_index = freeSpot();
-        int newRoot = postorder_zoom_in(node, newbdd_unused_node_index - 1, (2* factor), &newbdd_unused_node_index);
-        return bdd_nodes + newRoot;
+    if (factor > 0) {
+        int newRoot = postorder_zoom_in(node, INDEX(node), (2* factor));
+        if (newRoot < 0) { return NULL; } // node table is full.
+        return NODE(newRoot);
     }
 
-    else if (factor < 0){ // zoom out
+    else { // zoom out
         //debug("zoom factor of %i\n", factor);
         factor = factor * -1;
-        int newbdd_unused_node_index = freeSpot();
-        int newRoot = postorder_zoom_out(node, newbdd_unused_node_index- 1, (2* factor), &newbdd_unused_node_index);
-        return bdd_nodes + newRoot;
+        int newRoot = postorder_zoom_out(node, INDEX(node), (2* factor));
+        if (newRoot < 0) { return NULL; } // node table is full.
+        return NODE(newRoot);
+    }
+}
+
+/*
+ * Lossy approximation.
+ * Exact hash-consing shares only identical subgraphs, so a little noise defeats it. Here a
+ * subgraph may be replaced by a cheaper one as long as no pixel moves by more than a
+ * budget: one whose values span at most twice the budget becomes the leaf in the middle
+ * of them, and a node whose halves differ by at most the budget becomes its left half, used
+ * for both, with what is left of the budget spent further down. Every pixel's error is the
+ * sum of the budgets spent along its path, which never passes the tolerance. Ranges,
+ * distances and results all go through the computed table, so each node and each pair of
+ * siblings is looked at once, however many paths lead to it.
+ */
+static int bdd_approximate_tolerance;
+
+// The least and greatest values under a node, as max << 8 | min.
+static int bdd_range(int index) {
+    if (index < BDD_NUM_LEAVES) { return index << 8 | index; }
+    uint64_t key = CACHE_KEY(OP_RANGE, 0, index);
+    int range = bdd_cache_find(key);
+    if (range != -1) { return range; }
+
+    int left = bdd_range((*NODE(index)).left);
+    int right = bdd_range((*NODE(index)).right);
+    int min = (left & 0xFF) < (right & 0xFF) ? left & 0xFF : right & 0xFF;
+    int max = (left >> 8) > (right >> 8) ? left >> 8 : right >> 8;
+    return bdd_cache_store(key, max << 8 | min);
+}
+
+/*
+ * The largest difference between two nodes at any pixel of a block they both cover, or
+ * bdd_approximate_tolerance + 1 if it is more than that. The ranges settle most pairs
+ * without going down at all.
+ */
+static int bdd_distance(int a, int b) {
+    int limit = bdd_approximate_tolerance + 1;
+    if (a == b) { return 0; }
+    int rangeA = bdd_range(a);
+    int rangeB = bdd_range(b);
+    int minA = rangeA & 0xFF, maxA = rangeA >> 8, minB = rangeB & 0xFF, maxB = rangeB >> 8;
+    if (a < BDD_NUM_LEAVES || b < BDD_NUM_LEAVES) { // one value against a range.
+        int distance = maxA - minB > maxB - minA ? maxA - minB : maxB - minA;
+        return distance < limit ? distance : limit;
+    }
+    if (minA - minB > bdd_approximate_tolerance || minB - minA > bdd_approximate_tolerance
+        || maxA - maxB > bdd_approximate_tolerance || maxB - maxA > bdd_approximate_tolerance) {
+        return limit; // the extremes alone are too far apart.
+    }
+
+    if (a > b) { int t = a; a = b; b = t; }
+    uint64_t key = PAIR_KEY(OP_DISTANCE, a, b);
+    int distance = bdd_cache_find(key);
+    if (distance != -1) { return distance; }
+
+    BDD_NODE *nodeA = NODE(a);
+    BDD_NODE *nodeB = NODE(b);
+    int level = (*nodeA).level > (*nodeB).level ? (*nodeA).level : (*nodeB).level;
+    distance = bdd_distance(INDEX(LEFT(nodeA, level)), INDEX(LEFT(nodeB, level)));
+    if (distance < limit) {
+        int right = bdd_distance(INDEX(RIGHT(nodeA, level)), INDEX(RIGHT(nodeB, level)));
+        if (right > distance) { distance = right; }
+    }
+    return bdd_cache_store(key, distance);
+}
+
+// Approximate the subgraph at index with no pixel off by more than budget. Returns the index, or -1.
+static int bdd_approximate_from(int index, int budget) {
+    if (index < BDD_NUM_LEAVES) { return index; }
+    int range = bdd_range(index);
+    int min = range & 0xFF;
+    int max = range >> 8;
+    if (max - min <= 2 * budget) { return (min + max) / 2; } // flat enough for one value.
+    if (budget == 0) { return index; }
+
+    uint64_t key = CACHE_KEY(OP_APPROXIMATE, budget, index);
+    int node = bdd_cache_find(key);
+    if (node != -1) { return node; }
+
+    BDD_NODE *current = NODE(index);
+    int distance = bdd_distance((*current).left, (*current).right);
+    if (distance <= budget) {
+        node = bdd_approximate_from((*current).left, budget - distance);
     }
     else {
-        return NULL; // invalid.
+        int left = bdd_approximate_from((*current).left, budget);
+        int right = bdd_approximate_from((*current).right, budget);
+        node = left == -1 || right == -1 ? -1 : left == right ? left : bdd_lookup((*current).level, left, right);
+    }
+    return bdd_cache_store(key, node);
+}
+
+/*
+ * Build a BDD for the same image as node, but with no pixel differing by more than
+ * tolerance (0 to 255), and usually with far fewer nodes. Returns NULL if the node table
+ * fills up.
+ */
+BDD_NODE *bdd_approximate(BDD_NODE *node, int tolerance) {
+    if (node == NULL || tolerance < 0 || tolerance > 255) { return NULL; }
+    bdd_cache_flush(); // distances stored for another tolerance would be capped differently.
+    bdd_cache_reserve(bdd_node_high_water());
+    bdd_approximate_tolerance = tolerance;
+
+    int root = bdd_approximate_from(INDEX(node), tolerance);
+    if (root < 0) { return NULL; }
+    return NODE(root);
+}
+
+// Count the distinct nodes, leaves included, in a BDD: the records bdd_serialize() would write.
+static int bdd_count_from(int index, int count) {
+    if (SERIAL_OF(index) != 0) { return count; }
+    BDD_NODE *node = NODE(index);
+    if (index >= BDD_NUM_LEAVES) {
+        count = bdd_count_from((*node).left, count);
+        count = bdd_count_from((*node).right, count);
     }
-}
\ No newline at end of file
+    SET_SERIAL(index, ++count);
+    return count;
+}
+
+int bdd_node_count(BDD_NODE *node) {
+    if (node == NULL) { return 0; }
+    bdd_serial_begin();
+    int count = bdd_count_from(INDEX(node), 0);
+    bdd_serial_end(count + 1);
+    return count;
+}
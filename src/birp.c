@@ -7,20 +7,148 @@
 #include "const.h"
 #include "debug.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include "studentheaders.h"
 
+// The window given with -c, in effect when CROP_OPTION is set in global_options.
+int crop_x;
+int crop_y;
+int crop_width;
+int crop_height;
+
+// The number of gray levels given with -p, in effect when POSTERIZE_OPTION is set in global_options.
+int posterize_levels;
+
+// birp_to_pgm() decodes this many bytes of rows at a time, at most.
+#define PGM_BAND_BYTES (1 << 20)
+
+/*
+ * Work out the part of a width by height image to output: all of it, or with -c the part
+ * of the window that lies on it. Returns -1 if the window misses the image.
+ */
+static int output_window(int width, int height, int *x, int *y, int *w, int *h) {
+    if (!(global_options & CROP_OPTION)) {
+        *x = 0; *y = 0; *w = width; *h = height;
+        return 0;
+    }
+    if (crop_x >= width || crop_y >= height) { return -1; }
+    *x = crop_x;
+    *y = crop_y;
+    *w = crop_width < width - crop_x ? crop_width : width - crop_x;
+    *h = crop_height < height - crop_y ? crop_height : height - crop_y;
+    return 0;
+}
+
+/*
+ * Read a birp file to be output. With -c only the records the window needs are read, if
+ * the file has an index for that.
+ */
+static BDD_NODE *read_birp(FILE *in, int *width, int *height) {
+    if (!(global_options & CROP_OPTION)) { return img_read_birp(in, width, height); }
+    int side = 1 << (BDD_LEVELS_MAX / 2); // no image is wider or higher, which keeps the sums in range.
+    return img_read_birp_window(in, width, height, crop_x, crop_y,
+                                crop_width < side ? crop_width : side, crop_height < side ? crop_height : side);
+}
+
+/*
+ * Decode an image into raster_data: all of it, or with -c just the part of the window
+ * that lies on it. The dimensions are updated to those of what was decoded.
+ */
+static int decode_raster(BDD_NODE *root, int *width, int *height) {
+    int x, y, w, h;
+    if (root == NULL) { return -1; }
+    if (output_window(*width, *height, &x, &y, &w, &h) == -1) { return -1; }
+    if (bdd_to_raster_region(root, x, y, w, h, raster_data) == -1) { return -1; }
+    *width = w;
+    *height = h;
+    return 0;
+}
+
+/*
+ * Read a pgm image, returning its raster: the pixels where they lie in the input if that can
+ * be mapped, or else a copy in raster_data. Call img_unmap() once done with them.
+ */
+static unsigned char *read_pgm(FILE *in, int *width, int *height) {
+    unsigned char *pixels = NULL;
+    int mapped = img_map_pgm(in, width, height, &pixels);
+    if (mapped == 0 && (size_t) *width * *height > RASTER_SIZE_MAX) { mapped = -1; img_unmap(); } // same limit as unmapped input.
+    if (mapped == 1) {
+        if (img_read_pgm(in, width, height, raster_data, RASTER_SIZE_MAX) == -1) { return NULL; }
+        pixels = raster_data;
+    }
+    return mapped == -1 ? NULL : pixels;
+}
+
+/*
+ * The peak signal-to-noise ratio, in dB, of node decoded as a w by h image against raster:
+ * infinite if they match exactly, or -1 without memory to decode it in bands.
+ */
+static double approximation_psnr(BDD_NODE *node, unsigned char *raster, int w, int h) {
+    int band = 1;
+    while ((size_t) 2 * band * w <= PGM_BAND_BYTES && band < h) { band *= 2; }
+    unsigned char *decoded = malloc((size_t) band * w);
+    if (decoded == NULL) { return -1; }
+
+    double squares = 0;
+    for (int row = 0; row < h; row += band) {
+        int rows = band < h - row ? band : h - row;
+        bdd_to_raster_region(node, 0, row, w, rows, decoded);
+        unsigned char *original = raster + (size_t) row * w;
+        for (size_t i = 0; i < (size_t) w * rows; i++) {
+            int error = *(decoded + i) - *(original + i);
+            squares += error * error;
+        }
+    }
+    free(decoded);
+    if (squares == 0) { return INFINITY; }
+    return 10 * log10(255.0 * 255.0 * w * h / squares);
+}
+
 int pgm_to_birp(FILE *in, FILE *out) {
     int rasterWidth = 0;
     int rasterHeight = 0;
-    int readPgm = img_read_pgm(in, &rasterWidth, &rasterHeight, raster_data, RASTER_SIZE_MAX);
+    unsigned char *raster = read_pgm(in, &rasterWidth, &rasterHeight);
 
-    if (readPgm == -1) {
+    if (raster == NULL) {
         fprintf(stderr, "An error has occurred.\n");
         return -1;
         } // An error has occurred.
 
-    BDD_NODE *topNode = bdd_from_raster(rasterWidth, rasterHeight, raster_data);
+    BDD_NODE *topNode;
+    if (global_options & POSTERIZE_OPTION) {
+        // The exact BDD is built only to count it, so the saving can be reported. Its nodes are
+        // reclaimed before the posterized build rather than kept alongside.
+        int exactCount = bdd_node_count(bdd_from_raster(rasterWidth, rasterHeight, raster));
+        bdd_gc(0);
+        if (exactCount == 0 || bdd_set_posterize(posterize_levels) == -1) {
+            img_unmap();
+            fprintf(stderr, "An error has occurred.\n");
+            return -1;
+        }
+        topNode = bdd_from_raster(rasterWidth, rasterHeight, raster);
+        bdd_set_posterize(0);
+        if (topNode != NULL) {
+            int count = bdd_node_count(topNode);
+            fprintf(stderr, "Posterized to %d levels: %d nodes down to %d (%.1f%% fewer)\n", posterize_levels,
+                    exactCount, count, 100.0 * (exactCount - count) / exactCount);
+        }
+    }
+    else {
+        topNode = bdd_from_raster(rasterWidth, rasterHeight, raster);
+    }
+
+    // With -e, trade exactness for fewer nodes, and report what it cost.
+    if (topNode != NULL && (global_options & LOSSY_OPTION)) {
+        int exactCount = bdd_node_count(topNode);
+        topNode = bdd_approximate(topNode, (global_options & 0xFF0000) >> 16);
+        if (topNode != NULL) {
+            double psnr = approximation_psnr(topNode, raster, rasterWidth, rasterHeight);
+            fprintf(stderr, "Lossy encoding: %d nodes down to %d, PSNR %.2f dB\n", exactCount, bdd_node_count(topNode), psnr);
+        }
+    }
+    img_unmap();
     if (topNode == NULL) { fprintf(stderr, "An error has occurred.\n"); return -1;} // Some sort of error has occurred.
 
     // call img_write_birp to finish up.
@@ -37,11 +165,25 @@ int birp_to_pgm(FILE *in, FILE *out) {
 
     int height = 0;
     int width = 0;
-    BDD_NODE *root = img_read_birp(in, &width, &height);
-
-    bdd_to_raster(root, width, height, raster_data);
-
-    if (img_write_pgm(raster_data, width, height, out) == -1) { fprintf(stderr, "An error has occurred.\n"); return -1;}
+    int x, y, w, h;
+    BDD_NODE *root = read_birp(in, &width, &height);
+
+    if (root == NULL || output_window(width, height, &x, &y, &w, &h) == -1) { fprintf(stderr, "An error has occurred.\n"); return -1;}
+    if (img_write_pgm_header(w, h, out) == -1 || fflush(out) == EOF) { fprintf(stderr, "An error has occurred.\n"); return -1;}
+
+    // Decode a band of rows at a time into the front of raster_data and write it straight out,
+    // so only the band is ever touched. Bands are a power of two high, to line up with the blocks.
+    int band = 1;
+    while ((size_t) 2 * band * w <= PGM_BAND_BYTES && band < h) { band *= 2; }
+    for (int row = 0; row < h; row += band) {
+        int rows = band < h - row ? band : h - row;
+        if (bdd_to_raster_region(root, x, y + row, w, rows, raster_data) == -1
+            || fwrite(raster_data, 1, (size_t) w * rows, out) != (size_t) w * rows) {
+            fprintf(stderr, "An error has occurred.\n");
+            return -1;
+        }
+    }
+    if (fflush(out) == EOF) { fprintf(stderr, "An error has occurred.\n"); return -1;}
     return 0;
 }
 
@@ -164,14 +306,14 @@ int pgm_to_ascii(FILE *in, FILE *out) {
 
     int rasterWidth = 0;
     int rasterHeight = 0;
-    int readPgm = img_read_pgm(in, &rasterWidth, &rasterHeight, raster_data, RASTER_SIZE_MAX);
+    unsigned char *raster = read_pgm(in, &rasterWidth, &rasterHeight);
     int offset = 0;
 
-    if (readPgm == -1) { fprintf(stderr, "An error has occurred.\n"); return -1; } // An error has occurred.
+    if (raster == NULL) { fprintf(stderr, "An error has occurred.\n"); return -1; } // An error has occurred.
 
     for (int i = 0; i < rasterHeight; i++) {
         for (int j = 0; j < rasterWidth; j++) {
-            unsigned char toPrint = *(raster_data + offset);
+            unsigned char toPrint = *(raster + offset);
             if (toPrint <= 63) { fputc(' ', out);}
             else if (toPrint <= 127) { fputc('.', out); }
             else if (toPrint <= 191) { fputc('*', out); }
@@ -180,6 +322,7 @@ int pgm_to_ascii(FILE *in, FILE *out) {
         }
         fputc('\n', out);
     }
+    img_unmap();
     return 0;
 }
 
@@ -187,9 +330,9 @@ int birp_to_ascii(FILE *in, FILE *out) {
     int width = 0;
     int height = 0;
 
-    BDD_NODE *root = img_read_birp(in, &width, &height);
+    BDD_NODE *root = read_birp(in, &width, &height);
 
-    bdd_to_raster(root, width, height, raster_data);
+    if (decode_raster(root, &width, &height) == -1) { fprintf(stderr, "An error has occurred.\n"); return -1;}
     int offset = 0;
     for (int i = 0; i < height; i++) {
         for (int j = 0; j < width; j++) {
@@ -205,6 +348,61 @@ int birp_to_ascii(FILE *in, FILE *out) {
     return 0;
 }
 
+// Read a decimal number of at most 9 digits, or return -1 if that's not what the string holds.
+static int parse_decimal(char *string) {
+    if (string == NULL || *string == '\0') { return -1; }
+    int value = 0;
+    int digits = 0;
+    for (char *i = string; *i != '\0'; i++) {
+        if (*i < '0' || *i > '9' || ++digits > 9) { return -1; }
+        value = value * 10 + (*i - '0');
+    }
+    return value;
+}
+
+/*
+ * Parse "-c X Y W H", the crop window for birp decoded to pgm or ascii: W by H pixels
+ * whose top left is column X of row Y. Exactly those five arguments must remain.
+ */
+static int parse_crop(int count, char **args) {
+    if (count != 5) { return -1; }
+    char *flag = *args;
+    if (*flag != '-' || *(flag + 1) != 'c' || *(flag + 2) != '\0') { return -1; }
+
+    crop_x = parse_decimal(*(args + 1));
+    crop_y = parse_decimal(*(args + 2));
+    crop_width = parse_decimal(*(args + 3));
+    crop_height = parse_decimal(*(args + 4));
+    if (crop_x < 0 || crop_y < 0 || crop_width < 1 || crop_height < 1) { return -1; }
+    return 0;
+}
+
+/*
+ * Parse the options for pgm encoded to birp, each at most once and in either order:
+ * "-e MAXERROR", the most any pixel may change, from 0 to 255, and "-p LEVELS", the number
+ * of gray levels to quantize to, from 2 to 255. Only these may remain. Returns the bits to
+ * add to global_options, or -1.
+ */
+static int parse_encoding(int count, char **args) {
+    int options = 0;
+    for (int i = 0; i < count; i += 2) {
+        char *flag = *(args + i);
+        int value = i + 1 < count ? parse_decimal(*(args + i + 1)) : -1;
+        if (*flag != '-' || *(flag + 1) == '\0' || *(flag + 2) != '\0' || value == -1) { return -1; }
+
+        if (*(flag + 1) == 'e' && !(options & LOSSY_OPTION) && value <= 255) {
+            options += LOSSY_OPTION;
+            options += value << 16; // bits 16-23, the operation parameter, which encoding doesn't otherwise use.
+        }
+        else if (*(flag + 1) == 'p' && !(options & POSTERIZE_OPTION) && value >= 2 && value <= 255) {
+            options += POSTERIZE_OPTION;
+            posterize_levels = value;
+        }
+        else { return -1; }
+    }
+    return options;
+}
+
 /**
  * @brief Validates command line arguments passed to the program.
  * @details This function will validate all the arguments passed to the
@@ -447,38 +645,44 @@ int validargs(int argc, char **argv) {
     }
 
     else {
-        // If birp is not set as I/O and there are outstanding args, we have to return -1.
-        if (argsProcessed != argc) { return -1; }
-
-        // otherwise no need to check optional args, we can just return 1 after updating global_options.
-        else {
-            // Update global_options based on the i/o format.
-            switch (in) {
-                case 'p':
-                    global_options += 1;
-                    break;
-                case 'b':
-                    global_options += 2;
-                    break;
-                default:
-                    return -1; // Somehow input format is incorrect. Should never hit here, but just to be safe.
+        // If birp is not set as I/O, the only outstanding args allowed are a crop of a birp being decoded,
+        // or the options for pgm encoded to birp.
+        if (argsProcessed != argc) {
+            if (in == 'p' && out == 'b') {
+                int options = parse_encoding(argc - offset, argv + offset);
+                if (options == -1) { return -1; }
+                global_options += options;
             }
+            else if (in != 'b' || parse_crop(argc - offset, argv + offset) == -1) { return -1; }
+            else { global_options += CROP_OPTION; }
+        }
 
-            switch (out){
-                case 'p':
-                    global_options += 1 << 4;
-                    break;
-                case 'b':
-                    global_options += 2 << 4;
-                    break;
-                case 'a':
-                    global_options += 3 << 4;
-                    break;
-                default:
-                    return -1; // Same as above switch, just a failsafe.
-            }
+        // No other optional args to check, so just update global_options based on the i/o format.
+        switch (in) {
+            case 'p':
+                global_options += 1;
+                break;
+            case 'b':
+                global_options += 2;
+                break;
+            default:
+                return -1; // Somehow input format is incorrect. Should never hit here, but just to be safe.
+        }
 
-            return 0;
+        switch (out){
+            case 'p':
+                global_options += 1 << 4;
+                break;
+            case 'b':
+                global_options += 2 << 4;
+                break;
+            case 'a':
+                global_options += 3 << 4;
+                break;
+            default:
+                return -1; // Same as above switch, just a failsafe.
         }
+
+        return 0;
     }
 }
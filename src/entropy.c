@@ -0,0 +1,281 @@
+#define _GNU_SOURCE // fopencookie()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bdd.h"
+#include "studentheaders.h"
+
+/*
+ * Entropy coding of B6 record streams, for B7 files.
+ * Bytes are coded one bit at a time with an adaptive binary range coder, walking a binary tree
+ * of 255 probabilities per context (the scheme LZMA uses for its literals). The context of a
+ * byte is the field of the record it belongs to, which the coder tracks as the bytes go by:
+ * an opcode is coded in the context of the opcode before it, since levels come in runs; leaf
+ * values share one context; and each byte of a child reference has its own context by the
+ * record's level, which child it is, and how far into the LEB128 value it lies. Before every
+ * opcode a single bit says whether the stream goes on, so no length is needed up front.
+ *
+ * Both ends are stdio streams made with fopencookie(), so bdd_serialize_records() and
+ * bdd_deserialize_records() work through them unchanged, a buffer at a time.
+ */
+#define RC_TOP (1u << 24)
+#define RC_PROB_BITS 11
+#define RC_PROB_ONE (1 << RC_PROB_BITS)
+#define RC_ADAPT 5 // how fast probabilities move: 1/32 of the way each time.
+#define RC_TAIL_MAX 4 // zero bytes a decoder may read past the end before giving up.
+
+#define CTX_LEVELS (BDD_LEVELS_MAX + 1)
+#define CTX_VARINT_BYTES 5
+
+// What the next byte of the record stream is.
+#define FIELD_OPCODE 0
+#define FIELD_LEAF 1
+#define FIELD_REF 2
+
+// A context is a tree of 256 probabilities, one for each prefix of a byte's bits.
+#define RC_TREE 256
+#define RC_OPCODE_TREES 256                              // by the previous opcode.
+#define RC_REF_TREES (2 * CTX_VARINT_BYTES * CTX_LEVELS) // by child, byte and level.
+#define RC_MODEL_SIZE (1 + (RC_OPCODE_TREES + 1 + RC_REF_TREES) * RC_TREE)
+
+// The probabilities are one malloc'd block of RC_MODEL_SIZE, cut up between the contexts.
+typedef struct {
+    uint16_t *more;   // whether another record follows; the block starts here.
+    uint16_t *opcode;
+    uint16_t *leaf;
+    uint16_t *ref;
+} RC_MODEL;
+
+typedef struct {
+    int field;
+    int previous; // the last opcode.
+    int level;
+    int refs;     // child references in this record: 2, or 1 when the right one is implied.
+    int ref;      // the reference being coded,
+    int byte;     // and the byte of it.
+} RC_PARSE;
+
+typedef struct {
+    FILE *file;
+    RC_MODEL model;
+    RC_PARSE parse;
+    uint64_t low; // encoder state.
+    uint32_t range;
+    uint8_t cache;
+    uint64_t pending;
+    uint32_t code; // decoder state.
+    int tail;
+    int done;
+} RC_STREAM;
+
+// Start every probability at even odds. Returns 0, or -1 without memory.
+static int rc_model_init(RC_MODEL *model) {
+    uint16_t *p = malloc(RC_MODEL_SIZE * sizeof(uint16_t));
+    if (p == NULL) { return -1; }
+    for (size_t i = 0; i < RC_MODEL_SIZE; i++) {
+        *(p + i) = RC_PROB_ONE / 2;
+    }
+    model->more = p;
+    model->opcode = model->more + 1;
+    model->leaf = model->opcode + RC_OPCODE_TREES * RC_TREE;
+    model->ref = model->leaf + RC_TREE;
+    return 0;
+}
+
+// The probabilities to code the next byte of the stream with.
+static uint16_t *rc_context(RC_STREAM *s) {
+    RC_PARSE *parse = &s->parse;
+    if (parse->field == FIELD_OPCODE) { return s->model.opcode + (size_t) parse->previous * RC_TREE; }
+    if (parse->field == FIELD_LEAF) { return s->model.leaf; }
+    int byte = parse->byte < CTX_VARINT_BYTES ? parse->byte : CTX_VARINT_BYTES - 1;
+    size_t tree = ((size_t) parse->ref * CTX_VARINT_BYTES + byte) * CTX_LEVELS + parse->level;
+    return s->model.ref + tree * RC_TREE;
+}
+
+// Move past a byte of the stream, working out what the byte after it will be.
+static void rc_advance(RC_PARSE *parse, int c) {
+    if (parse->field == FIELD_OPCODE) {
+        parse->previous = c;
+        if (c == '@') { parse->field = FIELD_LEAF; return; }
+        int level = (c & 0x7f) - '@';
+        parse->level = level >= 0 && level < CTX_LEVELS ? level : 0;
+        parse->refs = c & 0x80 ? 1 : 2; // see BDD_RIGHT_PREVIOUS in bdd.c.
+        parse->ref = 0;
+        parse->byte = 0;
+        parse->field = FIELD_REF;
+    }
+    else if (parse->field == FIELD_LEAF) {
+        parse->field = FIELD_OPCODE;
+    }
+    else {
+        parse->byte++;
+        if (c & 0x80) { return; }
+        parse->byte = 0;
+        if (++parse->ref == parse->refs) { parse->field = FIELD_OPCODE; }
+    }
+}
+
+static int rc_shift_low(RC_STREAM *s) {
+    if ((uint32_t) s->low < 0xff000000u || (s->low >> 32) != 0) {
+        uint8_t carry = (uint8_t)(s->low >> 32);
+        uint8_t c = s->cache;
+        do {
+            if (putc((uint8_t)(c + carry), s->file) == EOF) { return -1; }
+            c = 0xff;
+        } while (--s->pending != 0);
+        s->cache = (uint8_t)(s->low >> 24);
+    }
+    s->pending++;
+    s->low = (s->low & 0x00ffffffu) << 8;
+    return 0;
+}
+
+static int rc_encode_bit(RC_STREAM *s, uint16_t *prob, int bit) {
+    uint32_t bound = (s->range >> RC_PROB_BITS) * *prob;
+    if (bit == 0) {
+        s->range = bound;
+        *prob += (RC_PROB_ONE - *prob) >> RC_ADAPT;
+    }
+    else {
+        s->low += bound;
+        s->range -= bound;
+        *prob -= *prob >> RC_ADAPT;
+    }
+    while (s->range < RC_TOP) {
+        s->range <<= 8;
+        if (rc_shift_low(s) == -1) { return -1; }
+    }
+    return 0;
+}
+
+static int rc_decode_bit(RC_STREAM *s, uint16_t *prob) {
+    uint32_t bound = (s->range >> RC_PROB_BITS) * *prob;
+    int bit;
+    if (s->code < bound) {
+        s->range = bound;
+        *prob += (RC_PROB_ONE - *prob) >> RC_ADAPT;
+        bit = 0;
+    }
+    else {
+        s->code -= bound;
+        s->range -= bound;
+        *prob -= *prob >> RC_ADAPT;
+        bit = 1;
+    }
+    while (s->range < RC_TOP) {
+        int c = getc(s->file);
+        if (c == EOF) { c = 0; s->tail++; } // the encoder's last bytes may be implied zeroes.
+        s->range <<= 8;
+        s->code = (s->code << 8) | (uint8_t) c;
+    }
+    return bit;
+}
+
+static int rc_encode_byte(RC_STREAM *s, uint16_t *probs, int c) {
+    int node = 1;
+    for (int i = 7; i >= 0; i--) {
+        int bit = (c >> i) & 1;
+        if (rc_encode_bit(s, probs + node, bit) == -1) { return -1; }
+        node = (node << 1) | bit;
+    }
+    return 0;
+}
+
+static int rc_decode_byte(RC_STREAM *s, uint16_t *probs) {
+    int node = 1;
+    while (node < 256) {
+        node = (node << 1) | rc_decode_bit(s, probs + node);
+    }
+    return node - 256;
+}
+
+// A cookie writer reports an error by returning 0, which stdio takes as the stream failing.
+static ssize_t rc_write(void *cookie, const char *data, size_t size) {
+    RC_STREAM *s = cookie;
+    for (size_t i = 0; i < size; i++) {
+        int c = (uint8_t) *(data + i);
+        if (s->parse.field == FIELD_OPCODE && rc_encode_bit(s, s->model.more, 0) == -1) { return 0; }
+        if (rc_encode_byte(s, rc_context(s), c) == -1) { return 0; }
+        rc_advance(&s->parse, c);
+    }
+    return size;
+}
+
+static ssize_t rc_read(void *cookie, char *data, size_t size) {
+    RC_STREAM *s = cookie;
+    size_t n = 0;
+    while (n < size && !s->done) {
+        if (s->parse.field == FIELD_OPCODE && rc_decode_bit(s, s->model.more) == 1) {
+            s->done = 1;
+            break;
+        }
+        int c = rc_decode_byte(s, rc_context(s));
+        if (s->tail > RC_TAIL_MAX) { return -1; } // the file ended in the middle of the stream.
+        *(data + n++) = (char) c;
+        rc_advance(&s->parse, c);
+    }
+    return n;
+}
+
+// Finish the encoder: mark the end of the records and push out what's left of the range.
+static int rc_close_writer(void *cookie) {
+    RC_STREAM *s = cookie;
+    int result = 0;
+    if (s->parse.field != FIELD_OPCODE || rc_encode_bit(s, s->model.more, 1) == -1) { result = -1; }
+    for (int i = 0; i < 5 && result == 0; i++) {
+        if (rc_shift_low(s) == -1) { result = -1; }
+    }
+    free(s->model.more);
+    free(s);
+    return result;
+}
+
+static int rc_close_reader(void *cookie) {
+    RC_STREAM *s = cookie;
+    free(s->model.more);
+    free(s);
+    return 0;
+}
+
+static RC_STREAM *rc_stream_new(FILE *file) {
+    RC_STREAM *s = calloc(1, sizeof(RC_STREAM));
+    if (s == NULL) { return NULL; }
+    if (rc_model_init(&s->model) == -1) { free(s); return NULL; }
+    s->file = file;
+    s->range = 0xffffffffu;
+    s->pending = 1;
+    return s;
+}
+
+/*
+ * Open a stream that entropy codes the B6 records written to it onto out. Closing it finishes
+ * the coding, but leaves out open. Returns NULL if it can't be made.
+ */
+FILE *entropy_open_writer(FILE *out) {
+    cookie_io_functions_t io = {NULL, rc_write, NULL, rc_close_writer};
+    RC_STREAM *s = out == NULL ? NULL : rc_stream_new(out);
+    if (s == NULL) { return NULL; }
+    FILE *stream = fopencookie(s, "w", io);
+    if (stream == NULL) { rc_close_reader(s); return NULL; }
+    return stream;
+}
+
+/*
+ * Open a stream that reads back the B6 records entropy coded from in, ending where they do.
+ * Returns NULL if it can't be made.
+ */
+FILE *entropy_open_reader(FILE *in) {
+    cookie_io_functions_t io = {rc_read, NULL, NULL, rc_close_reader};
+    RC_STREAM *s = in == NULL ? NULL : rc_stream_new(in);
+    if (s == NULL) { return NULL; }
+    // The first byte out of the encoder is always 0; the next four start the code.
+    for (int i = 0; i < 5; i++) {
+        int c = getc(in);
+        if (c == EOF) { rc_close_reader(s); return NULL; }
+        s->code = (s->code << 8) | (uint8_t) c;
+    }
+    FILE *stream = fopencookie(s, "r", io);
+    if (stream == NULL) { rc_close_reader(s); return NULL; }
+    return stream;
+}
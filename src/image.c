@@ -2,10 +2,23 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
-
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bdd.h"
 #include "image.h"
+#include "studentheaders.h"
+
+// The version of BIRP file img_write_birp() writes: 5, 6 for delta-coded child serials, or 7 for
+// those entropy coded as well.
+static int birp_version = 5;
+
+// Whether img_write_birp() follows B5 and B6 records with an index footer for region reads.
+static int birp_index;
+
+// The file mapped by img_map_pgm(), until img_unmap() releases it.
+static unsigned char *map_base;
+static size_t map_length;
 
 static int skip_whitespace(FILE *f) {
     int c;
@@ -113,12 +126,175 @@ bad:
     return -1;
 }
 
+// Skip whitespace in a mapped header, returning the first byte past it.
+static unsigned char *map_skip_whitespace(unsigned char *p, unsigned char *end) {
+    while (p < end && isspace(*p))
+	p++;
+    return p;
+}
+
+// Skip a comment line in a mapped header, newline included.
+static unsigned char *map_skip_comment(unsigned char *p, unsigned char *end) {
+    while (p < end && *p != '\n')
+	p++;
+    return p < end ? p + 1 : p;
+}
+
+// Read a decimal header field the way fscanf("%d") would, or return NULL if there is none.
+static unsigned char *map_read_int(unsigned char *p, unsigned char *end, int *value) {
+    int sign = 1;
+    long long v = 0;
+    p = map_skip_whitespace(p, end);
+    if (p < end && (*p == '-' || *p == '+')) {
+	if (*p == '-')
+	    sign = -1;
+	p++;
+    }
+    if (p == end || !isdigit(*p))
+	return NULL;
+    while (p < end && isdigit(*p)) {
+	if (v < 0x80000000LL)
+	    v = v * 10 + (*p - '0');
+	p++;
+    }
+    if (v > 0x7fffffffLL)
+	v = 0x7fffffffLL; // out of range: large enough to be refused by the size checks.
+    *value = sign * (int) v;
+    return p;
+}
+
+/*
+ * Parse a header in place, from the mapped bytes [p, end), following the same rules as the
+ * stdio path, which reads the magic and then calls img_read_header(). Returns the first byte
+ * after the header, or NULL.
+ */
+static unsigned char *map_read_header(unsigned char *p, unsigned char *end, char *magic, char *type,
+                                      int *wp, int *hp) {
+    int max;
+    p = map_skip_whitespace(p, end);
+    if (end - p < 2 || *p != *magic || *(p + 1) != *(magic + 1)) {
+        fprintf(stderr, "Invalid %s file (missing/bad magic)\n", type);
+        return NULL;
+    }
+    p += 2;
+    for (;;) {
+        p = map_skip_whitespace(p, end);
+        if (p == end) {
+            fprintf(stderr, "Invalid %s file (bad header)\n", type);
+            return NULL;
+        }
+        if (*p != '#')
+            break;
+        p = map_skip_comment(p, end);
+    }
+    if ((p = map_read_int(p, end, wp)) == NULL || (p = map_read_int(p, end, hp)) == NULL
+        || (p = map_read_int(p, end, &max)) == NULL) {
+        fprintf(stderr, "Invalid %s file (bad header parameters)\n", type);
+        return NULL;
+    }
+    // Comments may come before the single whitespace character that ends the header.
+    for (;;) {
+        if (p == end) {
+            fprintf(stderr, "Invalid %s file (bad comment/no data)\n", type);
+            return NULL;
+        }
+        if (*p == '#') {
+            p = map_skip_comment(p, end);
+            if (*(p - 1) != '\n') {
+                fprintf(stderr, "Invalid %s file (bad comment/no data)\n", type);
+                return NULL;
+            }
+            continue;
+        }
+        if (isspace(*p))
+            break;
+        fprintf(stderr, "Invalid %s file (no data)\n", type);
+        return NULL;
+    }
+    if (max >= 256) {
+	fprintf(stderr, "%s file maximum pixel value %d is too large (255 max supported)\n", type, max);
+	return NULL;
+    }
+    return p + 1;
+}
+
+/*
+ * Map the rest of a file that is a regular one, from its current position on. Returns 0 and
+ * sets *start to where that position lies in the mapping, or 1 if the file can't be mapped.
+ */
+static int map_file(FILE *file, unsigned char **start) {
+    struct stat st;
+    long position = ftell(file);
+    if (position < 0 || fstat(fileno(file), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= position)
+        return 1;
+
+    img_unmap();
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (base == MAP_FAILED)
+        return 1;
+    map_base = base;
+    map_length = st.st_size;
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    *start = map_base + position;
+    return 0;
+}
+
+/*
+ * If the file is a regular file, map it and parse the PGM header in place, so the raster can
+ * be used where it lies, through *pixels, without being copied. The mapping stays valid until
+ * img_unmap(), and the file is left positioned after the raster.
+ * Returns 0 on success, -1 if the image is invalid, or 1 if the file can't be mapped (a pipe,
+ * say), in which case nothing has been read and img_read_pgm() should be used instead.
+ */
+int img_map_pgm(FILE *file, int *wp, int *hp, unsigned char **pixels) {
+    unsigned char *start;
+    if (map_file(file, &start) == 1)
+        return 1;
+
+    unsigned char *end = map_base + map_length;
+    unsigned char *raster = map_read_header(start, end, "P5", "PGM", wp, hp);
+    if (raster == NULL)
+        goto bad;
+    if (*wp < 0 || *hp < 0)
+        goto bad;
+    if ((size_t) *wp * *hp > (size_t) (end - raster)) {
+        fprintf(stderr, "PGM file image data truncated\n");
+        goto bad;
+    }
+    fseek(file, (raster - map_base) + (long) *wp * *hp, SEEK_SET);
+    *pixels = raster;
+    return 0;
+
+ bad:
+    img_unmap();
+    return -1;
+}
+
+// Release the mapping made by img_map_pgm(), if there is one.
+void img_unmap(void) {
+    if (map_base != NULL)
+        munmap(map_base, map_length);
+    map_base = NULL;
+    map_length = 0;
+}
+
 // Spec: http://netpbm.sourceforge.net/doc/pgm.html
 int img_read_pgm(FILE *file, int *wp, int *hp, unsigned char *raster, size_t size) {
     int err;
-    int cc;
     unsigned int max;
     char magic[3];
+    unsigned char *pixels;
+
+    // A regular file is parsed in place and its raster copied out in one go.
+    if ((err = img_map_pgm(file, wp, hp, &pixels)) != 1) {
+        if (err == 0 && (size_t) *wp * *hp <= size)
+            memcpy(raster, pixels, (size_t) *wp * *hp);
+        else
+            err = -1;
+        img_unmap();
+        return err;
+    }
+
     if (fscanf(file, "%2s", magic) != 1 || strcmp(magic, "P5") != 0) {
         fprintf(stderr, "Invalid PGM file (missing/bad magic)\n");
         goto bad;
@@ -127,19 +303,13 @@ int img_read_pgm(FILE *file, int *wp, int *hp, unsigned char *raster, size_t siz
         goto bad;
 
     // Check that there is enough space to hold the data.
-    if(*wp * *hp * sizeof(unsigned char) > size)
+    if(*wp < 0 || *hp < 0 || (size_t) *wp * *hp > size)
     goto bad;
 
     // Read the raster.
-    unsigned char *dp = raster;
-    for(int i = 0; i < *hp; i++) {
-        for(int j = 0; j < *wp; j++) {
-            if ((cc = fgetc(file)) == EOF) {
-                fprintf(stderr, "PGM file image data truncated\n");
-                goto bad;
-            }
-            *dp++ = (unsigned char) cc;
-        }
+    if (fread(raster, 1, (size_t) *wp * *hp, file) != (size_t) *wp * *hp) {
+        fprintf(stderr, "PGM file image data truncated\n");
+        goto bad;
     }
     return 0;
 
@@ -147,24 +317,76 @@ int img_read_pgm(FILE *file, int *wp, int *hp, unsigned char *raster, size_t siz
     return -1;
 }
 
-int img_write_pgm(unsigned char *data, int w, int h, FILE *file) {
+// Write just the header of a PGM file, for a raster that follows in pieces.
+int img_write_pgm_header(int w, int h, FILE *file) {
     if (file == NULL) {
         return -1;
     }
-    fprintf(file, "P5 %d %d 255\n", w, h);
-    for(int i = 0; i < h; i++) {
-	for(int j = 0; j < w; j++) {
-	    fputc(data[i * w + j], file);
-	}
+    return fprintf(file, "P5 %d %d 255\n", w, h) < 0 ? -1 : 0;
+}
+
+int img_write_pgm(unsigned char *data, int w, int h, FILE *file) {
+    if (img_write_pgm_header(w, h, file) == -1) {
+        return -1;
     }
+    if (fwrite(data, 1, (size_t) w * h, file) != (size_t) w * h)
+        return -1;
     return fflush(file);
 }
 
-BDD_NODE *img_read_birp(FILE *file, int *wp, int *hp) {
+// Deserialize the entropy-coded records of a B7 file, which start at the file's current position.
+static BDD_NODE *read_coded_records(FILE *file) {
+    FILE *records = entropy_open_reader(file);
+    if (records == NULL) {
+        return NULL;
+    }
+    BDD_NODE *node = bdd_deserialize_records(records, 1);
+    if (ferror(records)) {
+        fprintf(stderr, "BIRP file data truncated\n");
+        node = NULL;
+    }
+    fclose(records);
+    return node;
+}
+
+/*
+ * Read a BIRP file, or with a window of w by h pixels at (x, y) as much of it as the window
+ * needs, if the file is mapped and has an index footer. A w of 0 means there is no window.
+ */
+static BDD_NODE *read_birp(FILE *file, int *wp, int *hp, int x, int y, int w, int h) {
     int c;
     unsigned int max;
     char magic[3];
-    if (fscanf(file, "%2s", magic) != 1 || strcmp(magic, "B5") != 0) {
+    unsigned char *start;
+
+    // A regular file is mapped, and the BDD built from the records where they lie.
+    if (map_file(file, &start) == 0) {
+        unsigned char *end = map_base + map_length;
+        unsigned char *first = map_skip_whitespace(start, end);
+        int version = end - first >= 2 && *first == 'B' && (*(first + 1) == '6' || *(first + 1) == '7') ? *(first + 1) - '0' : 5;
+        char *expected = version == 7 ? "B7" : version == 6 ? "B6" : "B5";
+        unsigned char *records = map_read_header(start, end, expected, "BIRP", wp, hp);
+        BDD_NODE *node = NULL;
+        if (records != NULL && version == 7) {
+            // The coded records go through stdio, so pick them up from the file itself.
+            fseek(file, records - map_base, SEEK_SET);
+            img_unmap();
+            return read_coded_records(file);
+        }
+        if (records != NULL && w > 0) {
+            madvise(map_base, map_length, MADV_RANDOM);
+            node = bdd_deserialize_window(records, end - records, version == 6, *wp, *hp, x, y, w, h);
+        }
+        if (records != NULL && node == NULL) {
+            node = bdd_deserialize_buffer(records, end - records, version == 6);
+        }
+        fseek(file, 0, SEEK_END);
+        img_unmap();
+        return node;
+    }
+
+    if (fscanf(file, "%2s", magic) != 1
+        || (strcmp(magic, "B5") != 0 && strcmp(magic, "B6") != 0 && strcmp(magic, "B7") != 0)) {
         fprintf(stderr, "Invalid BIRP file (missing/bad magic)\n");
         goto bad;
     }
@@ -173,18 +395,65 @@ BDD_NODE *img_read_birp(FILE *file, int *wp, int *hp) {
 	goto bad;
 
     // Read the serialized BDD.
-    BDD_NODE *node = bdd_deserialize(file);
+    if (*(magic + 1) == '7') {
+        return read_coded_records(file);
+    }
+    BDD_NODE *node = bdd_deserialize_records(file, *(magic + 1) == '6');
     return node;
 
  bad:
     return NULL;
 }
 
+BDD_NODE *img_read_birp(FILE *file, int *wp, int *hp) {
+    return read_birp(file, wp, hp, 0, 0, 0, 0);
+}
+
+/*
+ * Read the part of a BIRP file that the window of w by h pixels at (x, y) needs: the BDD that
+ * comes back matches the file's inside the window, but may be black outside it. Without an
+ * index footer, or from a pipe, the whole file is read as img_read_birp() would.
+ */
+BDD_NODE *img_read_birp_window(FILE *file, int *wp, int *hp, int x, int y, int w, int h) {
+    return read_birp(file, wp, hp, x, y, w, h);
+}
+
 int img_write_birp(BDD_NODE *node, int w, int h, FILE *file) {
     if (file == NULL) {
         return -1;
     }
-    fprintf(file, "B5 %d %d 255\n", w, h);
-    bdd_serialize(node, file);
+    fprintf(file, "B%d %d %d 255\n", birp_version, w, h);
+    if (birp_version == 7) {
+        // B6 records, entropy coded on their way out.
+        FILE *records = entropy_open_writer(file);
+        if (records == NULL) {
+            return -1;
+        }
+        int written = bdd_serialize_records(node, records, 1);
+        if (fclose(records) == EOF || written == -1) {
+            return -1;
+        }
+    }
+    else if (birp_index) {
+        if (bdd_serialize_indexed(node, w, h, file, birp_version == 6) == -1) {
+            return -1;
+        }
+    }
+    else if (bdd_serialize_records(node, file, birp_version == 6) == -1) {
+        return -1;
+    }
     return fflush(file);
 }
+
+/*
+ * Choose the version of BIRP file to write: 6 for delta-coded child serials, 7 for those
+ * entropy coded as well, or otherwise 5.
+ */
+void img_set_birp_version(int version) {
+    birp_version = version == 6 || version == 7 ? version : 5;
+}
+
+// Choose whether B5 and B6 files get an index footer (B7 files never do).
+void img_set_birp_index(int index) {
+    birp_index = index != 0;
+}
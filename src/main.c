@@ -3,18 +3,28 @@
 
 #include "const.h"
 #include "debug.h"
+#include "studentheaders.h"
 
 int main(int argc, char **argv) {
 
-    // Initialize hashmap.
-    for (int i = 0; i < BDD_HASH_SIZE; i++) {
+    // No table initialization needed here: the node and index tables start out zeroed,
+    // and the BDD functions reset the parts they use.
 
-        *(bdd_hash_map + i) = NULL;
-    }
-    // Initialize bdd_index_map.
-    for (int i = 0; i < BDD_NODES_MAX; i++) {
-        *(bdd_index_map + i) = 0;
-    }
+    // BIRP_THREADS sets how many threads build BDDs from rasters (0 means one per processor).
+    char *threads = getenv("BIRP_THREADS");
+    if (threads != NULL) { bdd_set_threads(atoi(threads)); }
+
+    // BIRP_TILE_CACHE sets how many drawn blocks decoding remembers for copying (0 turns it off).
+    char *tiles = getenv("BIRP_TILE_CACHE");
+    if (tiles != NULL) { bdd_set_tile_cache(atoi(tiles)); }
+
+    // BIRP_VERSION=6 writes birp files with delta-coded child serials, and 7 entropy codes them too
+    // (any version can be read).
+    char *version = getenv("BIRP_VERSION");
+    if (version != NULL) { img_set_birp_version(atoi(version)); }
+    // BIRP_INDEX=1 ends B5 and B6 files with an index, so crops read only the records they need.
+    char *index = getenv("BIRP_INDEX");
+    if (index != NULL) { img_set_birp_index(atoi(index)); }
 
     int valid = validargs(argc, argv);
     //debug("Valid args returned %i", valid);
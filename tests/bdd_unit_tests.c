@@ -3,10 +3,14 @@
 #include <criterion/hooks.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "const.h"
 #include "image.h"
 #include "test_help/test_help.h"
+#include "studentheaders.h"
 
 // https://github.com/codewars/codewars-runner-cli/blob/master/frameworks/c/criterion.c
 ReportHook(TEST_CRASH)(struct criterion_test_stats *stats) {
@@ -330,6 +334,105 @@ Test(unit_test_suite, bdd_lookup_hash_stress, .timeout=10) {
 			}
 }
 
+/*
+ * Look up triples that differ in only one of level, left and right.
+ * Each must get its own node, the index returned must hold exactly that
+ * triple, and looking a triple up again must give back the same index.
+ * Tests: bdd_lookup, bdd_node_at
+ */
+Test(unit_test_suite, bdd_lookup_key_fields_test, .timeout=5) {
+	int triples[][3] = {{1, 3, 5}, {1, 5, 3}, {2, 3, 5}, {1, 3, 6}, {1, 4, 5}};
+	int n = sizeof(triples) / sizeof(triples[0]);
+	int indices[5];
+
+	for (int i = 0; i < n; i++) {
+		indices[i] = bdd_lookup(triples[i][0], triples[i][1], triples[i][2]);
+		BDD_NODE *np = bdd_node_at(indices[i]);
+		cr_assert(np->level == triples[i][0] && np->left == triples[i][1] && np->right == triples[i][2],
+			"Index %d holds (%d, %d, %d), not triple %d", indices[i], np->level, np->left, np->right, i);
+		for (int j = 0; j < i; j++)
+			cr_assert_neq(indices[i], indices[j], "Triples %d and %d share a node", i, j);
+	}
+	for (int i = 0; i < n; i++)
+		cr_assert_eq(bdd_lookup(triples[i][0], triples[i][1], triples[i][2]), indices[i],
+			"Triple %d was not found again", i);
+}
+
+/*
+ * Free every node with an unrooted collection, then create as many new ones.
+ * The freed slots must be handed out again before the high-water mark moves,
+ * and the new nodes must be found again in their recycled slots.
+ * Tests: bdd_node_alloc, bdd_node_free, bdd_gc, bdd_lookup
+ */
+Test(unit_test_suite, bdd_node_reuse_test, .timeout=5) {
+	for (int i = 0; i < 100; i++)
+		bdd_lookup(1, i, i + 1);
+	int high_water = bdd_node_high_water();
+	cr_assert_eq(bdd_gc(0), 100, "Unrooted nodes were not all reclaimed");
+	cr_assert_eq(bdd_node_high_water(), high_water, "Collecting without compaction moved the high-water mark");
+
+	int indices[100];
+	for (int i = 0; i < 100; i++) {
+		indices[i] = bdd_lookup(2, i + 1, i);
+		cr_assert(indices[i] >= BDD_NUM_LEAVES && indices[i] < high_water, "Node %d went to fresh slot %d", i, indices[i]);
+	}
+	cr_assert_eq(bdd_node_high_water(), high_water, "The high-water mark moved while freed slots were left");
+	for (int i = 0; i < 100; i++)
+		cr_assert_eq(bdd_lookup(2, i + 1, i), indices[i], "Node %d was not found in its recycled slot", i);
+}
+
+/*
+ * Grow the unique table several times over with triples whose children use all of the
+ * packed key's index bits and whose levels reach the top. Nodes must be found again,
+ * with the same index, both while a grown table is still being drained and after.
+ * Tests: bdd_lookup
+ */
+Test(unit_test_suite, bdd_lookup_rehash_identity_test, .timeout=10) {
+	static int indices[40000];
+	int n = sizeof(indices) / sizeof(indices[0]);
+	int big = (1 << 28) - 1; // the largest index a key must hold.
+
+	for (int i = 0; i < n; i++) {
+		int level = BDD_LEVELS_MAX - i % 2;
+		indices[i] = bdd_lookup(level, big - i, i * 6151 % big);
+		cr_assert_geq(indices[i], BDD_NUM_LEAVES, "bdd_lookup failed on triple %d", i);
+		if (i % 5000 == 4999) // the table has just grown or is growing.
+			for (int j = 0; j <= i; j++)
+				cr_assert_eq(bdd_lookup(BDD_LEVELS_MAX - j % 2, big - j, j * 6151 % big), indices[j],
+					"Triple %d was lost after %d insertions", j, i + 1);
+	}
+	for (int i = 0; i < n; i++) {
+		BDD_NODE *np = bdd_node_at(indices[i]);
+		cr_assert(np->level == BDD_LEVELS_MAX - i % 2 && np->left == big - i && np->right == i * 6151 % big,
+			"Triple %d was stored wrongly", i);
+		cr_assert_neq(bdd_lookup(BDD_LEVELS_MAX - 1 + i % 2, big - i, i * 6151 % big), indices[i],
+			"Triples differing only in level share a node");
+	}
+}
+
+/*
+ * Rotate a 2x2 image, keep the rotation but free the image, then build a different image
+ * in the recycled slot. Rotation results are cached by node index, so the entry for the
+ * freed node must have been dropped by the flush, or the second rotation returns the first.
+ * Tests: bdd_rotate, bdd_gc, bdd_node_at
+ */
+Test(unit_test_suite, bdd_cache_flush_reuse_test, .timeout=5) {
+	int first = bdd_lookup(2, 10, 20); // rows 10 and 20, each one color.
+	BDD_NODE *kept = bdd_rotate(bdd_node_at(first), 2);
+	cr_assert_not_null(kept, "bdd_rotate failed");
+	bdd_gc_register_root(&kept);
+	cr_assert_eq(bdd_gc(0), 1, "Only the unrotated image should have been reclaimed");
+
+	int second = bdd_lookup(2, 30, 40);
+	cr_assert_eq(second, first, "The second image should reuse the freed slot");
+	BDD_NODE *rotated = bdd_rotate(bdd_node_at(second), 2);
+	cr_assert_not_null(rotated, "bdd_rotate failed");
+	for (int r = 0; r < 2; r++)
+		for (int c = 0; c < 2; c++)
+			cr_assert_eq(bdd_apply(rotated, 1 - c, r), r == 0 ? 30 : 40, "Pixel (%d, %d) rotated wrongly", r, c);
+	bdd_gc_unregister_root(&kept);
+}
+
 /**
  * deserialize the textual representation and serialize bdd node tree back to textual representation, the results should be exact same
  */
@@ -365,3 +468,550 @@ Test(unit_test_suite, bdd_serialize, .timeout=5) {  // suite_name, test_name
         cr_assert_eq(1, 0) ;
     }
 }
+
+/*
+ * Rotate a bdd, keep only the rotated one alive and collect with compaction.
+ * The rotated image must survive unchanged while the original is reclaimed.
+ * Tests: bdd_gc, bdd_gc_register_root
+ */
+Test(unit_test_suite, bdd_gc_compact_test, .timeout=5) {
+	unsigned char test_raster[64];
+	unsigned char exp_raster[64];
+	init_test_raster(test_raster);
+
+	BDD_NODE *root = bdd_from_raster(8, 8, test_raster);
+	BDD_NODE *rotated = bdd_rotate(root, root->level);
+	for (int i = 0; i < 64; i++)
+		exp_raster[i] = bdd_apply(rotated, i / 8, i % 8);
+
+	cr_assert_eq(bdd_gc_register_root(&rotated), 0, "Could not register root");
+	int high_water = bdd_node_high_water();
+	int reclaimed = bdd_gc(1);
+	cr_assert_gt(reclaimed, 0, "Unreachable nodes of the original bdd were not reclaimed");
+	cr_assert_lt(bdd_node_high_water(), high_water, "Compaction did not lower the high-water mark");
+
+	for (int i = 0; i < 64; i++)
+		cr_assert_eq(bdd_apply(rotated, i / 8, i % 8), exp_raster[i], "Pixel %d changed by garbage collection", i);
+
+	bdd_gc_unregister_root(&rotated);
+}
+
+/*
+ * Make the same triple twice across a reset of the unique table, keep both alive
+ * and compact, then let the later copy go. The earlier copy must stay the node
+ * that lookups find, rather than being lost along with the later one.
+ * Tests: bdd_gc, bdd_hash_reset, bdd_lookup
+ */
+Test(unit_test_suite, bdd_gc_compact_duplicate_test, .timeout=5) {
+	BDD_NODE *first = bdd_node_at(bdd_lookup(3, 17, 42));
+	bdd_hash_reset();
+	BDD_NODE *second = bdd_node_at(bdd_lookup(3, 17, 42));
+	cr_assert_neq(first, second, "The reset table still found the first copy");
+
+	cr_assert_eq(bdd_gc_register_root(&first), 0, "Could not register root");
+	cr_assert_eq(bdd_gc_register_root(&second), 0, "Could not register root");
+	bdd_gc(1);
+	bdd_gc_unregister_root(&second);
+	bdd_gc(0);
+
+	cr_assert_eq(bdd_lookup(3, 17, 42), bdd_node_index(first), "Lookup lost the surviving copy");
+	bdd_gc_unregister_root(&first);
+}
+
+/*
+ * Create more nodes than fit in the static bdd_nodes array.
+ * The node table must grow instead of failing, and every node
+ * must still be found again afterwards.
+ * Tests: bdd_lookup, bdd_node_at
+ */
+Test(unit_test_suite, bdd_lookup_growth_test, .timeout=10) {
+	int target = BDD_NODES_MAX + 4096;
+	int created = 0;
+	int last = -1;
+
+	for (int level = 1; level <= BDD_LEVELS_MAX && created < target; level++)
+		for (int l = 0; l < BDD_NUM_LEAVES && created < target; l++)
+			for (int r = 0; r < BDD_NUM_LEAVES && created < target; r++) {
+				if (l == r)
+					continue;
+				last = bdd_lookup(level, l, r);
+				cr_assert_geq(last, BDD_NUM_LEAVES, "bdd_lookup failed after %d nodes", created);
+				created++;
+			}
+
+	cr_assert_geq(last, BDD_NODES_MAX, "Last node should live past the static table");
+	BDD_NODE *np = bdd_node_at(last);
+	cr_assert_eq(bdd_lookup(np->level, np->left, np->right), last, "Node past the static table was not retrieved");
+}
+
+/*
+ * Rotate a bdd whose root skips its top row level.
+ * Four quarter turns must give back the very same root node, and
+ * the first turn must turn vertical stripes into horizontal ones.
+ * Tests: bdd_lookup, bdd_rotate
+ */
+Test(unit_test_suite, bdd_rotate_odd_root_test, .timeout=5) {
+	// 4x4 image, left half black and right half white: the root splits on the column bit.
+	int stripes = bdd_lookup(3, 0, 255);
+	BDD_NODE *root = bdd_node_at(stripes);
+
+	BDD_NODE *turned = bdd_rotate(root, 4);
+	cr_assert_not_null(turned, "bdd_rotate failed on an odd-level root");
+	cr_assert_eq(turned->level, 4, "Rotated root should split on the row bit");
+	cr_assert_eq(turned->left, 255, "Top half should come from the right half");
+	cr_assert_eq(turned->right, 0, "Bottom half should come from the left half");
+
+	BDD_NODE *back = turned;
+	for (int i = 0; i < 3; i++)
+		back = bdd_rotate(back, 4);
+	cr_assert_eq(back, root, "Four quarter turns did not give back the same node");
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_LEAVES 64
+
+static int concurrent_results[CONCURRENT_THREADS][CONCURRENT_LEAVES * CONCURRENT_LEAVES];
+
+static void *concurrent_lookup_worker(void *arg) {
+	long t = (long)arg;
+	int n = CONCURRENT_LEAVES * CONCURRENT_LEAVES;
+	// Each thread walks the same triples in its own order.
+	for (int k = 0; k < n; k++) {
+		int i = (int)(((long)k * (2 * t + 3) + t * 101) % n);
+		concurrent_results[t][i] = bdd_lookup_concurrent(1, i / CONCURRENT_LEAVES, i % CONCURRENT_LEAVES);
+	}
+	return NULL;
+}
+
+/*
+ * Have several threads look up the same triples at once.
+ * Every thread must get the same index for a triple, and the
+ * serial bdd_lookup must find those same nodes afterwards.
+ * Tests: bdd_concurrent_begin, bdd_lookup_concurrent, bdd_concurrent_end
+ */
+Test(unit_test_suite, bdd_lookup_concurrent_test, .timeout=10) {
+	int n = CONCURRENT_LEAVES * CONCURRENT_LEAVES;
+	pthread_t threads[CONCURRENT_THREADS];
+
+	cr_assert_eq(bdd_concurrent_begin(n), 0, "Could not reserve room for the concurrent section");
+	for (long t = 0; t < CONCURRENT_THREADS; t++)
+		pthread_create(&threads[t], NULL, concurrent_lookup_worker, (void *)t);
+	for (int t = 0; t < CONCURRENT_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	bdd_concurrent_end();
+
+	for (int i = 0; i < n; i++) {
+		cr_assert_geq(concurrent_results[0][i], 0, "bdd_lookup_concurrent failed on triple %d", i);
+		for (int t = 1; t < CONCURRENT_THREADS; t++)
+			cr_assert_eq(concurrent_results[t][i], concurrent_results[0][i], "Threads disagree on triple %d", i);
+		cr_assert_eq(bdd_lookup(1, i / CONCURRENT_LEAVES, i % CONCURRENT_LEAVES), concurrent_results[0][i],
+			"bdd_lookup did not find the node built concurrently for triple %d", i);
+	}
+}
+
+/*
+ * Build a raster too large for one task on several threads.
+ * The parallel build must serialize to the same bytes as the serial one.
+ * Tests: bdd_set_threads, bdd_from_raster
+ */
+Test(unit_test_suite, bdd_from_raster_parallel_test, .timeout=10) {
+	static unsigned char raster[200 * 150];
+	for (int i = 0; i < 200 * 150; i++)
+		raster[i] = (i / 200) * (i % 200) % 7 == 0 ? (i % 251) : 0; // patchy, with some repeated tiles.
+
+	char *serial_bytes, *parallel_bytes;
+	size_t serial_size, parallel_size;
+
+	bdd_set_threads(1);
+	FILE *out = open_memstream(&serial_bytes, &serial_size);
+	cr_assert_eq(bdd_serialize(bdd_from_raster(200, 150, raster), out), 0, "Serial build failed");
+	fclose(out);
+
+	bdd_set_threads(4);
+	out = open_memstream(&parallel_bytes, &parallel_size);
+	cr_assert_eq(bdd_serialize(bdd_from_raster(200, 150, raster), out), 0, "Parallel build failed");
+	fclose(out);
+	bdd_set_threads(1);
+
+	cr_assert_eq(parallel_size, serial_size, "Parallel build has a different size");
+	cr_assert_eq(memcmp(parallel_bytes, serial_bytes, serial_size), 0, "Parallel build differs from the serial one");
+	free(serial_bytes);
+	free(parallel_bytes);
+}
+
+/*
+ * The bdd of the block at the given level whose top left pixel is (r, c), built top-down
+ * one pixel at a time the way bdd_from_raster used to: an even level splits the block into
+ * top and bottom halves, an odd one into left and right, and anything past the edge is 0.
+ */
+static int reference_build(int level, int r, int c, int w, int h, unsigned char *raster) {
+	if (r >= h || c >= w)
+		return 0;
+	if (level == 0)
+		return raster[r * w + c];
+	int rows = 1 << (level / 2), cols = 1 << ((level + 1) / 2);
+	int left = reference_build(level - 1, r, c, w, h, raster);
+	int right = level % 2 == 0 ? reference_build(level - 1, r + rows / 2, c, w, h, raster)
+	                           : reference_build(level - 1, r, c + cols / 2, w, h, raster);
+	return left == right ? left : bdd_lookup(level, left, right);
+}
+
+/*
+ * Build rasters of many sizes, some smaller than one tile and most not powers of two,
+ * with flat patches, repeated tiles and noise. Each must come out as the very node the
+ * pixel-by-pixel reference builds.
+ * Tests: bdd_from_raster, bdd_lookup
+ */
+Test(unit_test_suite, bdd_from_raster_reference_test, .timeout=10) {
+	static const int sizes[][2] = {{1, 1}, {2, 1}, {3, 5}, {7, 16}, {15, 9}, {16, 16}, {17, 33},
+	                               {32, 32}, {100, 37}, {61, 130}, {200, 150}};
+	static unsigned char raster[200 * 150];
+	unsigned int seed = 12345;
+	for (int i = 0; i < 200 * 150; i++) {
+		seed = seed * 1103515245 + 12345;
+		int x = i % 200, y = i / 200;
+		if (y < 50)
+			raster[i] = (x / 5 + y / 3) % 4 * 60; // flat patches.
+		else if (y < 100)
+			raster[i] = (x % 16) * 16 + y % 16; // one tile, repeated.
+		else
+			raster[i] = (seed >> 16) % 3 == 0 ? (seed >> 8) % 256 : 128; // sparse noise.
+	}
+
+	for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		int w = sizes[s][0], h = sizes[s][1];
+		unsigned char *pixels = raster + (200 * 150 - w * h) / 2; // straddles the bands.
+		BDD_NODE *root = bdd_from_raster(w, h, pixels);
+		cr_assert_not_null(root, "bdd_from_raster failed on %dx%d", w, h);
+		int expected = reference_build(min_bdd_level(h, w), 0, 0, w, h, pixels);
+		cr_assert_eq(root, bdd_node_at(expected), "%dx%d built a different bdd than the reference", w, h);
+	}
+}
+
+/*
+ * Build rows that take each path through the pixel merge: a single color, flat pairs of
+ * differing colors, flat runs broken by one differing pair per vector, and pairs that all
+ * differ. The odd width leaves a last pixel with nothing to pair with. Runs again with a
+ * leaf map that makes some differing pixels equal. Each build must match the reference.
+ * Tests: bdd_from_raster, bdd_set_posterize
+ */
+Test(unit_test_suite, bdd_merge_pixels_runs_test, .timeout=5) {
+	static unsigned char raster[48 * 16];
+	static unsigned char mapped[48 * 16];
+	for (int i = 0; i < 48 * 16; i++) {
+		int r = i / 48, c = i % 48;
+		switch (r / 4) {
+		case 0: raster[i] = 77; break;
+		case 1: raster[i] = c / 2 * 5; break;
+		case 2: raster[i] = c % 16 == 9 ? 200 : 100 + c / 16; break;
+		default: raster[i] = (c * 31 + r) % 256; break;
+		}
+	}
+
+	for (int w = 48; w >= 47; w--) {
+		BDD_NODE *root = bdd_from_raster(w, 16, raster);
+		cr_assert_eq(root, bdd_node_at(reference_build(min_bdd_level(16, w), 0, 0, w, 16, raster)),
+			"%d wide rows built a different bdd than the reference", w);
+	}
+
+	for (int i = 0; i < 48 * 16; i++)
+		mapped[i] = (raster[i] * 4 / 256 * 255 + 1) / 3;
+	cr_assert_eq(bdd_set_posterize(4), 0, "bdd_set_posterize failed");
+	BDD_NODE *root = bdd_from_raster(48, 16, raster);
+	bdd_set_posterize(0);
+	cr_assert_eq(root, bdd_node_at(reference_build(min_bdd_level(16, 48), 0, 0, 48, 16, mapped)),
+		"Posterized rows built a different bdd than the reference");
+}
+
+/*
+ * Encode a raster whose top and bottom halves are the same, so that
+ * the root skips the top row level, and decode it again.
+ * Tests: bdd_from_raster, bdd_to_raster, bdd_apply
+ */
+Test(unit_test_suite, bdd_to_raster_odd_root_test, .timeout=5) {
+	unsigned char raster[16 * 16];
+	unsigned char decoded[16 * 16];
+	for (int i = 0; i < 16 * 16; i++)
+		raster[i] = ((i % 128) * 37) % 256;
+
+	BDD_NODE *root = bdd_from_raster(16, 16, raster);
+	cr_assert_eq(root->level % 2, 1, "Root should sit at an odd level");
+
+	bdd_to_raster(root, 16, 16, decoded);
+	for (int i = 0; i < 16 * 16; i++) {
+		cr_assert_eq(decoded[i], raster[i], "bdd_to_raster got pixel %d wrong", i);
+		cr_assert_eq(bdd_apply(root, i / 16, i % 16), raster[i], "bdd_apply got pixel %d wrong", i);
+	}
+}
+
+/*
+ * Decode a raster made of one repeated 16x16 tile, clipped at the edges,
+ * with and without tile copying.
+ * Tests: bdd_set_tile_cache, bdd_to_raster
+ */
+Test(unit_test_suite, bdd_to_raster_tile_copy_test, .timeout=5) {
+	static unsigned char raster[100 * 70];
+	static unsigned char copied[100 * 70];
+	static unsigned char drawn[100 * 70];
+	for (int i = 0; i < 100 * 70; i++)
+		raster[i] = ((i / 100 % 16) * 16 + (i % 100 % 16)) * 7 % 256;
+
+	BDD_NODE *root = bdd_from_raster(100, 70, raster);
+	bdd_to_raster(root, 100, 70, copied);
+	bdd_set_tile_cache(0);
+	bdd_to_raster(root, 100, 70, drawn);
+	bdd_set_tile_cache(4096);
+
+	cr_assert_eq(memcmp(copied, raster, sizeof(raster)), 0, "Decoding with tile copies changed the image");
+	cr_assert_eq(memcmp(drawn, raster, sizeof(raster)), 0, "Decoding without tile copies changed the image");
+}
+
+/*
+ * Sample a bdd at scattered points, repeats included, in one batch.
+ * Every value must match the raster and a single bdd_apply.
+ * Tests: bdd_apply_batch, bdd_apply
+ */
+Test(unit_test_suite, bdd_apply_batch_test, .timeout=5) {
+	static unsigned char raster[60 * 45];
+	int coords[2 * 500];
+	unsigned char values[500];
+	for (int i = 0; i < 60 * 45; i++)
+		raster[i] = (i / 60 / 4 + i % 60 / 3) % 5 * 50;
+	for (int i = 0; i < 500; i++) {
+		coords[2 * i] = (i * 7) % 45;
+		coords[2 * i + 1] = (i * 13) % 60;
+	}
+
+	BDD_NODE *root = bdd_from_raster(60, 45, raster);
+	cr_assert_eq(bdd_apply_batch(root, coords, 500, values), 0, "bdd_apply_batch failed");
+	for (int i = 0; i < 500; i++) {
+		unsigned char expected = raster[coords[2 * i] * 60 + coords[2 * i + 1]];
+		cr_assert_eq(values[i], expected, "Batch got point %d wrong", i);
+		cr_assert_eq(bdd_apply(root, coords[2 * i], coords[2 * i + 1]), expected, "bdd_apply got point %d wrong", i);
+	}
+}
+
+/*
+ * Decode a window out of the middle of an image.
+ * It must match the same rectangle cut from the source raster.
+ * Tests: bdd_to_raster_region
+ */
+Test(unit_test_suite, bdd_to_raster_region_test, .timeout=5) {
+	static unsigned char raster[90 * 75];
+	unsigned char window[37 * 20];
+	for (int i = 0; i < 90 * 75; i++)
+		raster[i] = (i / 90 * 3 + i % 90 * 5) % 256;
+
+	BDD_NODE *root = bdd_from_raster(90, 75, raster);
+	cr_assert_eq(bdd_to_raster_region(root, 41, 13, 37, 20, window), 0, "bdd_to_raster_region failed");
+	for (int r = 0; r < 20; r++)
+		for (int c = 0; c < 37; c++)
+			cr_assert_eq(window[r * 37 + c], raster[(13 + r) * 90 + 41 + c], "Wrong pixel at (%d, %d)", r, c);
+	cr_assert_eq(bdd_to_raster_region(root, -1, 0, 5, 5, window), -1, "Negative origin was accepted");
+}
+
+/*
+ * Serialize a bdd into memory and read it back from the buffer.
+ * It must decode to the original image, and a record cut short must be refused.
+ * Tests: bdd_serialize, bdd_deserialize_buffer
+ */
+Test(unit_test_suite, bdd_deserialize_buffer_test, .timeout=5) {
+	static unsigned char raster[40 * 30];
+	static unsigned char decoded[40 * 30];
+	char *buffer = NULL;
+	size_t size = 0;
+	for (int i = 0; i < 40 * 30; i++)
+		raster[i] = (i / 40 * i % 40) % 7 * 30;
+
+	BDD_NODE *root = bdd_from_raster(40, 30, raster);
+	FILE *out = open_memstream(&buffer, &size);
+	bdd_serialize(root, out);
+	fclose(out);
+
+	BDD_NODE *copy = bdd_deserialize_buffer((uint8_t *)buffer, size, 0);
+	cr_assert_not_null(copy, "bdd_deserialize_buffer failed");
+	bdd_to_raster(copy, 40, 30, decoded);
+	cr_assert_eq(memcmp(decoded, raster, sizeof(raster)), 0, "The deserialized bdd is a different image");
+	cr_assert_null(bdd_deserialize_buffer((uint8_t *)buffer, size - 3, 0), "A truncated record was accepted");
+	free(buffer);
+}
+
+/*
+ * Serialize a bdd too big for one buffer of records, so it goes out in several writes.
+ * Every node must be written once, and reading it back must give the same image.
+ * Tests: bdd_serialize, bdd_deserialize_buffer
+ */
+Test(unit_test_suite, bdd_serialize_chunked_test, .timeout=10) {
+	static unsigned char raster[400 * 300];
+	static unsigned char decoded[400 * 300];
+	char *buffer = NULL;
+	size_t size = 0;
+	for (int i = 0; i < 400 * 300; i++)
+		raster[i] = (i * 2654435761u ^ (unsigned) i * i * 40503u) >> 24;
+
+	BDD_NODE *root = bdd_from_raster(400, 300, raster);
+	FILE *out = open_memstream(&buffer, &size);
+	cr_assert_eq(bdd_serialize(root, out), 0, "bdd_serialize failed");
+	fclose(out);
+	cr_assert_gt(size, 1 << 18, "The image was too small to need more than one write");
+
+	BDD_NODE *copy = bdd_deserialize_buffer((uint8_t *)buffer, size, 0);
+	cr_assert_not_null(copy, "bdd_deserialize_buffer failed");
+	bdd_to_raster(copy, 400, 300, decoded);
+	cr_assert_eq(memcmp(decoded, raster, sizeof(raster)), 0, "The image changed going through serialization");
+	free(buffer);
+}
+
+/*
+ * Feed the deserializers records that refer to children not built yet, to a child at the
+ * node's own level, or that use a byte that isn't an opcode. Each must be refused.
+ * Tests: bdd_deserialize, bdd_deserialize_buffer
+ */
+Test(unit_test_suite, bdd_deserialize_validation_test, .timeout=5) {
+	// Two leaves and a level 1 node over them, with serials 1, 2 and 3.
+	uint8_t good[] = {'@', 0, '@', 255, 'A', 1, 0, 0, 0, 2, 0, 0, 0};
+	uint8_t forward[] = {'@', 0, '@', 255, 'A', 1, 0, 0, 0, 3, 0, 0, 0};
+	uint8_t level[] = {'@', 0, '@', 255, 'A', 1, 0, 0, 0, 2, 0, 0, 0, 'A', 3, 0, 0, 0, 1, 0, 0, 0};
+	uint8_t opcode[] = {'@', 0, '@', 255, 'A', 1, 0, 0, 0, 2, 0, 0, 0, '\n'};
+
+	cr_assert_not_null(bdd_deserialize_buffer(good, sizeof(good), 0), "A well-formed bdd was refused");
+	cr_assert_null(bdd_deserialize_buffer(forward, sizeof(forward), 0), "A forward reference was accepted");
+	cr_assert_null(bdd_deserialize_buffer(level, sizeof(level), 0), "A child at the node's level was accepted");
+	cr_assert_null(bdd_deserialize_buffer(opcode, sizeof(opcode), 0), "A bad opcode was accepted");
+
+	FILE *in = fmemopen(forward, sizeof(forward), "r");
+	cr_assert_null(bdd_deserialize(in), "A forward reference was accepted from a stream");
+	fclose(in);
+	in = fmemopen(good, sizeof(good), "r");
+	BDD_NODE *root = bdd_deserialize(in);
+	fclose(in);
+	cr_assert_not_null(root, "A well-formed bdd was refused from a stream");
+	cr_assert_eq(bdd_apply(root, 0, 1), 255, "The stream gave the wrong bdd");
+}
+
+/*
+ * Serialize the same bdd with fixed and with delta-coded child serials.
+ * The delta-coded records must be smaller and read back to the same image, from a buffer or a stream.
+ * Tests: bdd_serialize_records, bdd_deserialize_buffer, bdd_deserialize_records
+ */
+Test(unit_test_suite, bdd_serialize_delta_test, .timeout=5) {
+	static unsigned char raster[120 * 90];
+	static unsigned char decoded[120 * 90];
+	char *fixed = NULL, *delta = NULL;
+	size_t fixedSize = 0, deltaSize = 0;
+	for (int i = 0; i < 120 * 90; i++)
+		raster[i] = (i / 120 / 5 + i % 120 / 3) % 6 * 40;
+
+	BDD_NODE *root = bdd_from_raster(120, 90, raster);
+	FILE *out = open_memstream(&fixed, &fixedSize);
+	bdd_serialize_records(root, out, 0);
+	fclose(out);
+	out = open_memstream(&delta, &deltaSize);
+	bdd_serialize_records(root, out, 1);
+	fclose(out);
+	cr_assert_lt(2 * deltaSize, fixedSize, "Delta-coded records are %zu bytes against %zu", deltaSize, fixedSize);
+
+	BDD_NODE *copy = bdd_deserialize_buffer((uint8_t *)delta, deltaSize, 1);
+	cr_assert_not_null(copy, "bdd_deserialize_buffer failed");
+	bdd_to_raster(copy, 120, 90, decoded);
+	cr_assert_eq(memcmp(decoded, raster, sizeof(raster)), 0, "The image changed going through delta-coded records");
+
+	FILE *in = fmemopen(delta, deltaSize, "r");
+	copy = bdd_deserialize_records(in, 1);
+	fclose(in);
+	cr_assert_not_null(copy, "bdd_deserialize_records failed");
+	memset(decoded, 0, sizeof(decoded));
+	bdd_to_raster(copy, 120, 90, decoded);
+	cr_assert_eq(memcmp(decoded, raster, sizeof(raster)), 0, "The image changed reading delta-coded records from a stream");
+	free(fixed);
+	free(delta);
+}
+
+/*
+ * Serialize a bdd with an index footer, then read back just a window of it.
+ * A full read must ignore the footer, the window must decode like the original image, and
+ * records without a footer, or a window over most of the image, must be refused by the
+ * window read.
+ * Tests: bdd_serialize_indexed, bdd_deserialize_window, bdd_deserialize_buffer
+ */
+Test(unit_test_suite, bdd_deserialize_window_test, .timeout=10) {
+	static unsigned char raster[300 * 200];
+	static unsigned char decoded[300 * 200];
+	char *buffer = NULL;
+	size_t size = 0;
+	for (int i = 0; i < 300 * 200; i++)
+		raster[i] = i / 300 < 100 ? (i * 2654435761u) >> 24 : (i % 300 / 30) * 25;
+
+	BDD_NODE *root = bdd_from_raster(300, 200, raster);
+	for (int delta = 0; delta < 2; delta++) {
+		FILE *out = open_memstream(&buffer, &size);
+		cr_assert_eq(bdd_serialize_indexed(root, 300, 200, out, delta), 0, "bdd_serialize_indexed failed");
+		fclose(out);
+
+		BDD_NODE *copy = bdd_deserialize_buffer((uint8_t *)buffer, size, delta);
+		cr_assert_not_null(copy, "A full read of indexed records failed");
+		bdd_to_raster(copy, 300, 200, decoded);
+		cr_assert_eq(memcmp(decoded, raster, sizeof(raster)), 0, "The index changed the image");
+
+		copy = bdd_deserialize_window((uint8_t *)buffer, size, delta, 300, 200, 71, 83, 150, 40);
+		cr_assert_not_null(copy, "bdd_deserialize_window failed");
+		cr_assert_eq(bdd_to_raster_region(copy, 71, 83, 150, 40, decoded), 0, "bdd_to_raster_region failed");
+		for (int r = 0; r < 40; r++)
+			for (int c = 0; c < 150; c++)
+				cr_assert_eq(decoded[r * 150 + c], raster[(83 + r) * 300 + 71 + c], "Wrong pixel at (%d, %d)", r, c);
+		cr_assert_null(bdd_deserialize_window((uint8_t *)buffer, size, delta, 300, 200, 20, 0, 300, 200),
+			"A window over most of the image should be left to a full read");
+		free(buffer);
+	}
+
+	FILE *out = open_memstream(&buffer, &size);
+	bdd_serialize(root, out);
+	fclose(out);
+	cr_assert_null(bdd_deserialize_window((uint8_t *)buffer, size, 0, 300, 200, 0, 0, 10, 10), "Records without an index were accepted");
+	free(buffer);
+}
+
+/*
+ * Approximate a noisy image of flat blocks within an error bound.
+ * No pixel may move by more than the bound, and the approximation must need fewer nodes.
+ * Tests: bdd_approximate, bdd_node_count
+ */
+Test(unit_test_suite, bdd_approximate_test, .timeout=5) {
+	static unsigned char raster[128 * 96];
+	static unsigned char decoded[128 * 96];
+	for (int i = 0; i < 128 * 96; i++)
+		raster[i] = i / 128 / 24 * 50 + i % 128 / 32 * 30 + ((i * 2654435761u) >> 29);
+
+	BDD_NODE *root = bdd_from_raster(128, 96, raster);
+	BDD_NODE *approximation = bdd_approximate(root, 6);
+	cr_assert_not_null(approximation, "bdd_approximate failed");
+	cr_assert_lt(2 * bdd_node_count(approximation), bdd_node_count(root), "The approximation has %d nodes against %d",
+		bdd_node_count(approximation), bdd_node_count(root));
+	bdd_to_raster(approximation, 128, 96, decoded);
+	for (int i = 0; i < 128 * 96; i++)
+		cr_assert(abs(decoded[i] - raster[i]) <= 6, "Pixel %d moved from %d to %d", i, raster[i], decoded[i]);
+	cr_assert_eq(bdd_approximate(root, 0), root, "An error bound of 0 changed the bdd");
+}
+
+/*
+ * Build a gradient posterized to 4 gray levels.
+ * Every pixel must land on the level its value falls in, and the bdd must shrink.
+ * Tests: bdd_set_posterize, bdd_from_raster
+ */
+Test(unit_test_suite, bdd_posterize_test, .timeout=5) {
+	static unsigned char raster[256 * 64];
+	static unsigned char decoded[256 * 64];
+	static const unsigned char levels[] = {0, 85, 170, 255};
+	for (int i = 0; i < 256 * 64; i++)
+		raster[i] = i % 256;
+
+	int exact = bdd_node_count(bdd_from_raster(256, 64, raster));
+	cr_assert_eq(bdd_set_posterize(4), 0, "bdd_set_posterize failed");
+	BDD_NODE *root = bdd_from_raster(256, 64, raster);
+	bdd_set_posterize(0);
+	cr_assert_not_null(root, "bdd_from_raster failed");
+	cr_assert_lt(bdd_node_count(root), exact, "Posterizing didn't shrink the bdd");
+	bdd_to_raster(root, 256, 64, decoded);
+	for (int i = 0; i < 256 * 64; i++)
+		cr_assert_eq(decoded[i], levels[raster[i] / 64], "Pixel %d went from %d to %d", i, raster[i], decoded[i]);
+}
@@ -417,3 +417,51 @@ Test(blackbox_tests, birp_to_birp_2, .timeout=10){
 	retCode1 = WEXITSTATUS(system(cmp));
 	cr_assert_eq(retCode1, EXIT_SUCCESS, "test_output/checker_birp.birp does not match reference output");
 }
+
+Test(blackbox_tests, pgm_2_birp_piped, .timeout=10){
+
+	system("mkdir -p test_output");
+
+	// Through a pipe the input can't be mapped, so this reads it with stdio instead.
+	char *cmd = "ulimit -t 10; bin/birp -o pgm < tests/rsrc/stone.birp > test_output/stone_piped.pgm"
+		" && cat test_output/stone_piped.pgm | bin/birp -i pgm > test_output/stone_piped.birp"
+		" && bin/birp -i pgm < test_output/stone_piped.pgm > test_output/stone_mapped.birp";
+	char *cmp = "cmp test_output/stone_piped.birp test_output/stone_mapped.birp";
+
+	int return_code = WEXITSTATUS(system(cmd));
+	cr_assert_eq(return_code, EXIT_SUCCESS, "Program exited with %d instead of EXIT_SUCCESS", return_code);
+	return_code = WEXITSTATUS(system(cmp));
+	cr_assert_eq(return_code, EXIT_SUCCESS, "Piped and mapped pgm input encoded differently.");
+}
+
+Test(blackbox_tests, birp_2_pgm_streamed_zoom, .timeout=10){
+
+	system("mkdir -p test_output");
+
+	// 8320x8320 is more than raster_data holds, so this only works if the pgm is written in bands.
+	char *cmd = "ulimit -t 10; bin/birp -Z 6 < tests/rsrc/stone.birp | bin/birp -o pgm > test_output/stone_zoom.pgm";
+	char *cmp = "test $(wc -c < test_output/stone_zoom.pgm) -eq $((17 + 8320 * 8320))";
+
+	int return_code = WEXITSTATUS(system(cmd));
+	cr_assert_eq(return_code, EXIT_SUCCESS, "Program exited with %d instead of EXIT_SUCCESS", return_code);
+	return_code = WEXITSTATUS(system(cmp));
+	cr_assert_eq(return_code, EXIT_SUCCESS, "The zoomed pgm is the wrong size.");
+}
+
+Test(blackbox_tests, birp_2_birp_entropy_coded, .timeout=10){
+
+	system("mkdir -p test_output");
+
+	// Write stone as an entropy-coded B7 file, then read it back, from the file and through a pipe.
+	char *cmd = "ulimit -t 10; BIRP_VERSION=7 bin/birp < tests/rsrc/stone.birp > test_output/stone.b7"
+		" && bin/birp < test_output/stone.b7 > test_output/stone_b7_mapped.birp"
+		" && cat test_output/stone.b7 | bin/birp > test_output/stone_b7_piped.birp";
+	char *cmp = "cmp test_output/stone_b7_mapped.birp tests/rsrc/stone.birp"
+		" && cmp test_output/stone_b7_piped.birp tests/rsrc/stone.birp"
+		" && test $(wc -c < test_output/stone.b7) -lt $(($(wc -c < tests/rsrc/stone.birp) / 3))";
+
+	int return_code = WEXITSTATUS(system(cmd));
+	cr_assert_eq(return_code, EXIT_SUCCESS, "Program exited with %d instead of EXIT_SUCCESS", return_code);
+	return_code = WEXITSTATUS(system(cmp));
+	cr_assert_eq(return_code, EXIT_SUCCESS, "stone did not come back unchanged from a B7 file a third its size.");
+}
@@ -2,6 +2,7 @@
 #include <criterion/logging.h>
 
 #include "const.h"
+#include "studentheaders.h"
 
 static char *progname = "bin/birp";
 
@@ -246,3 +247,57 @@ Test(invalid_args_tests, out_of_order, .timeout=5){
 			global_options, exp_opt);
 }
 
+
+Test(validargs_tests_suite, valid_args_crop_test, .timeout = 5)
+{
+    char *argv[] = {progname, "-o", "pgm", "-c", "4", "8", "15", "16", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d", ret, exp_ret);
+    cr_assert_eq(opt & 0x1000, 0x1000, "Crop bit not set for -c. Got: %x", opt);
+    cr_assert(crop_x == 4 && crop_y == 8 && crop_width == 15 && crop_height == 16,
+              "Wrong crop window %d %d %d %d", crop_x, crop_y, crop_width, crop_height);
+}
+
+Test(invalid_args_tests, crop_needs_birp_input, .timeout=5){
+	char* argv[] = {progname, "-i", "pgm", "-o", "ascii", "-c", "0", "0", "4", "4", NULL};
+	int argc = (sizeof(argv)/sizeof(char*))-1;
+	int ret = validargs(argc, argv);
+	cr_assert_eq(ret, -1, "Invalid return for invalid args. Got: %d | Expected: %d",
+			ret, -1);
+}
+
+Test(validargs_tests_suite, valid_args_lossy_test, .timeout = 5)
+{
+    char *argv[] = {progname, "-i", "pgm", "-e", "12", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int exp_opt = 0x21 | LOSSY_OPTION | 12 << 16;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d", ret, exp_ret);
+    cr_assert_eq(opt, exp_opt, "Invalid options settings.  Got: 0x%x | Expected: 0x%x", opt, exp_opt);
+}
+
+Test(invalid_args_tests, lossy_needs_birp_output, .timeout=5){
+	char* argv[] = {progname, "-i", "pgm", "-o", "pgm", "-e", "4", NULL};
+	int argc = (sizeof(argv)/sizeof(char*))-1;
+	int ret = validargs(argc, argv);
+	cr_assert_eq(ret, -1, "Invalid return for invalid args. Got: %d | Expected: %d",
+			ret, -1);
+}
+
+Test(validargs_tests_suite, valid_args_posterize_test, .timeout = 5)
+{
+    char *argv[] = {progname, "-i", "pgm", "-o", "birp", "-p", "16", "-e", "3", NULL};
+    int argc = (sizeof(argv) / sizeof(char *)) - 1;
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    int opt = global_options;
+    int exp_opt = 0x21 | LOSSY_OPTION | POSTERIZE_OPTION | 3 << 16;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d", ret, exp_ret);
+    cr_assert_eq(opt, exp_opt, "Invalid options settings.  Got: 0x%x | Expected: 0x%x", opt, exp_opt);
+    cr_assert_eq(posterize_levels, 16, "Wrong number of levels %d", posterize_levels);
+}